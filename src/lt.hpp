@@ -185,9 +185,20 @@ struct FileContents
     FileError error;
 };
 
+// Read-only view of a whole file, mapped in memory instead of copied.
+struct FileMapping
+{
+    void     *data;
+    isize     size;
+    FileError error;
+};
+
 FileContents *file_read_contents(const char *filename);
 void          file_free_contents(FileContents *fc);
 isize         file_get_size(const char *filename);
+i64           file_get_modification_time(const char *filename);
+FileMapping  *file_map(const char *filename);
+void          file_unmap(FileMapping *fm);
 
 /////////////////////////////////////////////////////////
 //
@@ -224,9 +235,23 @@ struct Array
 };
 
 template<typename T> Array<T>  array_make();
+template<typename T> Array<T>  array_make(isize capacity);
 template<typename T> void      array_free(Array<T> *arr);
 template<typename T> void      array_push(Array<T> *arr, T val);
 
+/////////////////////////////////////////////////////////
+//
+// Threads
+//
+// Fork-join helper: runs the same procedure on a number of threads and waits
+// for all of them to finish. The calling thread works as thread 0.
+//
+
+typedef void (*ThreadProc)(void *data, i32 thread_index);
+
+i32  thread_hardware_count();
+void thread_run_parallel  (ThreadProc proc, void *data, i32 num_threads);
+
 #endif // INCLUDE_LT_H
 
 
@@ -255,6 +280,10 @@ template<typename T> void      array_push(Array<T> *arr, T val);
 
 #if defined(__unix__)
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <X11/extensions/Xrandr.h>
 #endif
 
@@ -339,6 +368,68 @@ file_free_contents(FileContents *fc)
     lt_free(fc);
 }
 
+FileMapping *
+file_map(const char *filename)
+{
+#if defined(__unix__)
+    FileMapping *ret = (FileMapping*)malloc(sizeof(*ret));
+    ret->data = NULL;
+    ret->size = -1;
+
+    i32 fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        ret->error = FileError_NotExists;
+        return ret;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        ret->error = FileError_Unknown;
+        return ret;
+    }
+
+    ret->size = st.st_size;
+    ret->error = FileError_None;
+
+    // Mapping zero bytes fails, an empty file is just an empty view.
+    if (ret->size > 0)
+    {
+        void *data = mmap(NULL, ret->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            ret->error = FileError_Read;
+            ret->size = -1;
+        }
+        else
+        {
+            madvise(data, ret->size, MADV_SEQUENTIAL);
+            ret->data = data;
+        }
+    }
+
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+    return ret;
+#else
+#  error "Still not implemented"
+#endif
+}
+
+void
+file_unmap(FileMapping *fm)
+{
+#if defined(__unix__)
+    if (fm->data)
+        munmap(fm->data, fm->size);
+    lt_free(fm);
+#else
+#  error "Still not implemented"
+#endif
+}
+
 isize
 file_get_size(const char *filename)
 {
@@ -353,6 +444,21 @@ file_get_size(const char *filename)
 #endif
 }
 
+// In nanoseconds, -1 if the file does not exist.
+i64
+file_get_modification_time(const char *filename)
+{
+#if defined(__unix__)
+    struct stat st;
+    if (stat(filename, &st) < 0)
+        return -1;
+    else
+        return ((i64)st.st_mtim.tv_sec * 1000000000) + st.st_mtim.tv_nsec;
+#else
+#  error "Still not implemented"
+#endif
+}
+
 ///////////////////////////////////////////////////////
 //
 // String
@@ -406,7 +512,7 @@ string__grow(String *str)
 
     if (!new_data) LT_Fail("Could not allocate more memory\n");
 
-    memset(str->data+str->len, 0, new_capacity - str->capacity);
+    memset(new_data+str->capacity, 0, new_capacity - str->capacity);
 
     str->data = new_data;
     str->capacity = new_capacity;
@@ -425,7 +531,8 @@ string_concat(String *str, const char *rhs)
         string__grow(str);
     }
 
-    memcpy(str->data, rhs, rhs_len);
+    memcpy(str->data+str->len, rhs, rhs_len);
+    str->len += rhs_len;
 }
 
 ///////////////////////////////////////////////////////
@@ -444,6 +551,17 @@ array_make(void)
     return arr;
 }
 
+template<typename T> Array<T>
+array_make(isize capacity)
+{
+    const i32 INITIAL_CAP = 8;
+    Array<T> arr = {};
+    arr.len = 0;
+    arr.capacity = lt_max(capacity, (isize)INITIAL_CAP);
+    arr.data = (T*)calloc(arr.capacity, sizeof(T));
+    return arr;
+}
+
 template<typename T> void
 array_free(Array<T> *arr)
 {
@@ -488,6 +606,68 @@ Array<T>::operator[](isize i)
     return this->data[i];
 }
 
+///////////////////////////////////////////////////////
+//
+// Threads
+//
+
+struct ThreadStart
+{
+    ThreadProc  proc;
+    void       *data;
+    i32         thread_index;
+};
+
+internal void *
+thread__entry(void *arg)
+{
+    ThreadStart *start = (ThreadStart*)arg;
+    start->proc(start->data, start->thread_index);
+    return NULL;
+}
+
+i32
+thread_hardware_count()
+{
+#if defined(__unix__)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count < 1) ? 1 : (i32)count;
+#else
+#  error "Still not implemented"
+#endif
+}
+
+void
+thread_run_parallel(ThreadProc proc, void *data, i32 num_threads)
+{
+    LT_Assert(proc != NULL);
+    LT_Assert(num_threads > 0);
+
+#if defined(__unix__)
+    pthread_t   *threads = (pthread_t*)malloc(sizeof(pthread_t) * num_threads);
+    ThreadStart *starts = (ThreadStart*)malloc(sizeof(ThreadStart) * num_threads);
+
+    for (i32 i = 1; i < num_threads; i++)
+    {
+        starts[i].proc = proc;
+        starts[i].data = data;
+        starts[i].thread_index = i;
+        if (pthread_create(&threads[i], NULL, thread__entry, &starts[i]) != 0)
+            LT_Fail("Failed creating thread %d\n", i);
+    }
+
+    proc(data, 0);
+
+    for (i32 i = 1; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    free(starts);
+    free(threads);
+#else
+#  error "Still not implemented"
+#endif
+}
+
 ///////////////////////////////////////////////////////
 //
 // Utils
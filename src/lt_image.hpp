@@ -6,6 +6,8 @@
 
 #define TGA_IMAGE_HEADER_SIZE 18
 #define TGA_IMAGE_FOOTER_SIZE 26
+// Enough mipmap levels for the biggest image a TGA file can describe (65535 pixels).
+#define TGA_IMAGE_MAX_LEVELS 17
 
 union Vec4i;
 union Vec3i;
@@ -26,6 +28,39 @@ enum TGAType {
     TGAType_RunLength_BlackWhite = 11,
 };
 
+// How the texels of each level are ordered in memory.
+enum TGALayout {
+    // Row after row, as in the file.
+    TGALayout_Linear = 0,
+    // 4x4 blocks of texels stored one after the other, row after row of blocks. With
+    // RGBA8 storage a block is one 64 byte cache line, so neighbouring texels on both
+    // axes are usually in the same line.
+    TGALayout_Blocked = 1,
+};
+
+#define TGA_BLOCK_SIZE 4
+// Alignment of the texel data of a texture, one cache line.
+#define TGA_TEXTURE_ALIGNMENT 64
+
+// How each texel of a texture is stored, at the index given by the layout.
+enum TGAStorage {
+    // One u32 per texel, 0xAARRGGBB, with the alpha of the file. Texels of files without
+    // alpha are opaque.
+    TGAStorage_RGBA8 = 0,
+    // Three bytes per texel, blue, green and red as in the file.
+    TGAStorage_RGB8 = 1,
+    // A plane of bytes for each of red, green and blue, every plane ordered by the
+    // layout and holding all of the levels.
+    TGAStorage_Planar = 2,
+};
+
+// How the pixels are stored by lt_image_write_to_file.
+enum TGACompression {
+    TGACompression_None = 0,
+    // Run length packets, as image type 10 for color images and 11 for grayscale ones.
+    TGACompression_RunLength = 1,
+};
+
 static_assert(TGAPixel_Gray/8 == sizeof(u8), "8 bits");
 static_assert(TGAPixel_RGB/8 == sizeof(u8)*3, "24 bits");
 static_assert(TGAPixel_RGBA/8 == sizeof(u32), "32 bits");
@@ -55,33 +90,51 @@ struct TGAImageFooter {
     u8     zero_string_terminator;
 };
 
-struct TGAImageGray {
-    TGAImageHeader   header;
-    TGAImageFooter   footer;
-    u8              *data;
-};
-
-struct TGAImageRGBA {
+// An image with every pixel stored as a T, in its packed width: u8 for grayscale images
+// and u32 (0xAARRGGBB) for color ones. Row zero is the bottom row of the image.
+template<typename T>
+struct TGAImage {
     TGAImageHeader    header;
     TGAImageFooter    footer;
-    u32              *data;
+    T                *data;
+    // Zero for images stored row after row. Otherwise the pixels are stored in square
+    // tiles of this size, one tile after the other and row after row inside a tile.
+    u16               tile_size;
 };
 
+typedef TGAImage<u8>  TGAImageGray;
+typedef TGAImage<u32> TGAImageRGBA;
+
 struct TGAImageRGB {
     TGAImageHeader    header;
     TGAImageFooter    footer;
-    u32              *data;
+    // The full image followed by every mipmap level, in a single allocation.
+    u8               *data;
+    TGALayout         layout;
+    TGAStorage        storage;
+    // Texels of all of the levels, which is also the size of a plane.
+    isize             num_texels;
+    i32               num_levels;
+    isize             level_offsets[TGA_IMAGE_MAX_LEVELS];
 };
 
 TGAImageGray *lt_image_make_gray     (u16 width, u16 height);
 TGAImageRGBA *lt_image_make_rgba     (u16 width, u16 height);
-TGAImageRGB  *lt_image_load_rgb      (const char *filepath);
+TGAImageRGBA *lt_image_make_rgba_tiled(u16 width, u16 height, u16 tile_size);
+TGAImageRGB  *lt_image_load_rgb      (const char *filepath, TGALayout layout = TGALayout_Linear,
+                                      TGAStorage storage = TGAStorage_RGBA8);
+template<typename T> TGAImage<T> *lt_image_load(const char *filepath);
 void          lt_image_fill          (TGAImageGray *img, u8 v);
 void          lt_image_fill          (TGAImageRGBA *img, const Vec4i c);
 void          lt_image_set           (TGAImageGray *img, u16 x, u16 y, u8 v);
 void          lt_image_set           (TGAImageRGBA *img, u16 x, u16 y, const Vec4i c);
 Vec3i         lt_image_get           (TGAImageRGB  *img, u16 x, u16 y);
-template<typename T> void lt_image_write_to_file(const T *img, const char *filepath);
+u32           lt_image_sample        (const TGAImageRGB *img, f32 u, f32 v);
+u32           lt_image_sample_trilinear(const TGAImageRGB *img, f32 u, f32 v, f32 lod);
+isize         lt_image_texel_index   (const TGAImageRGB *img, i32 level, i32 x, i32 y);
+isize         lt_image_pixel_index   (const TGAImageRGBA *img, i32 x, i32 y);
+template<typename T> void lt_image_write_to_file(const T *img, const char *filepath,
+                                                  TGACompression compression = TGACompression_None);
 template<typename T> i32 lt_image_height(T *img);
 template<typename T> i32 lt_image_width(T *img);
 template<typename T> i32 lt_image_area(T *img);
@@ -117,8 +170,18 @@ template<typename T> i32 lt_image_area(T *img);
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "lt_math.hpp"
 
+#if defined(__SSSE3__)
+#  include <tmmintrin.h>
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
 typedef u8 RepetitionCount;
 
 inline u32
@@ -138,20 +201,158 @@ unpack_rgb(u32 c)
     return Vec3i(r, g, b);
 }
 
-template<typename T> internal void
-write_image_data(const T *img, FILE *fd)
+// Texel at an index of the texture data, as 0xAARRGGBB.
+internal inline u32
+texel_load(const TGAImageRGB *img, isize index)
+{
+    switch (img->storage)
+    {
+    case TGAStorage_RGB8:
+    {
+        const u8 *texel = img->data + (index * 3);
+        return 0xff000000 | (texel[2] << 16) | (texel[1] << 8) | texel[0];
+    }
+    case TGAStorage_Planar:
+        return 0xff000000 | (img->data[index] << 16) | (img->data[img->num_texels + index] << 8) |
+            img->data[(2 * img->num_texels) + index];
+    default:
+        return ((const u32*)img->data)[index];
+    }
+}
+
+internal inline void
+texel_store(TGAImageRGB *img, isize index, u32 c)
+{
+    switch (img->storage)
+    {
+    case TGAStorage_RGB8:
+    {
+        u8 *texel = img->data + (index * 3);
+        texel[0] = c & 0xff;
+        texel[1] = (c >> 8) & 0xff;
+        texel[2] = (c >> 16) & 0xff;
+    } break;
+    case TGAStorage_Planar:
+        img->data[index] = (c >> 16) & 0xff;
+        img->data[img->num_texels + index] = (c >> 8) & 0xff;
+        img->data[(2 * img->num_texels) + index] = c & 0xff;
+        break;
+    default:
+        ((u32*)img->data)[index] = c;
+    }
+}
+
+// Interpolates the four u8 lanes of two texels, with the weight of b in 256ths. Red and
+// blue, then alpha and green, are worked on together as 16 bit lanes of a u32, which
+// cannot overflow since the weights add up to 256.
+internal inline u32
+lerp_texels(u32 a, u32 b, u32 t)
+{
+    const u32 s = 256 - t;
+    const u32 rb = ((((a & 0x00ff00ff) * s) + ((b & 0x00ff00ff) * t) + 0x00800080) >> 8) & 0x00ff00ff;
+    const u32 ag = ((((a >> 8) & 0x00ff00ff) * s) + (((b >> 8) & 0x00ff00ff) * t) + 0x00800080) & 0xff00ff00;
+    return rb | ag;
+}
+
+// Rounded average of the u8 lanes of four texels, with the same 16 bit lanes.
+internal inline u32
+average_texels(u32 a, u32 b, u32 c, u32 d)
+{
+    const u32 rb = (a & 0x00ff00ff) + (b & 0x00ff00ff) + (c & 0x00ff00ff) + (d & 0x00ff00ff) + 0x00020002;
+    const u32 ag = ((a >> 8) & 0x00ff00ff) + ((b >> 8) & 0x00ff00ff) + ((c >> 8) & 0x00ff00ff) +
+        ((d >> 8) & 0x00ff00ff) + 0x00020002;
+    return ((rb >> 2) & 0x00ff00ff) | ((ag << 6) & 0xff00ff00);
+}
+
+// Pixels of an image in the file format. The data points either straight at the image
+// data, when it is already stored like in the file, or at a buffer owned by the payload.
+struct TGAPayload {
+    const void   *data;
+    isize         size;
+    void         *buffer;
+};
+
+// Images stored row after row, with pixels as wide as in the file, are written as is.
+template<typename T> internal TGAPayload
+image_payload(const T *img)
 {
-    for (isize i = 0; i < img->header.image_width*img->header.image_height; i++)
-        LT_Assert(fwrite(&img->data[i], img->header.pixel_depth/8, 1, fd) == 1);
+    TGAPayload payload = {};
+    payload.data = img->data;
+    payload.size = (isize)img->header.image_width * img->header.image_height * (img->header.pixel_depth / 8);
+    return payload;
+}
+
+// Linear images are written straight from their data. Tiled images are detiled into a
+// buffer, copying the part of a tile row that falls inside the image at once.
+internal TGAPayload
+image_payload(const TGAImageRGBA *img)
+{
+    const i32 width = img->header.image_width;
+    const i32 height = img->header.image_height;
+
+    TGAPayload payload = {};
+    payload.size = (isize)width * height * sizeof(u32);
+    if (img->tile_size == 0)
+    {
+        payload.data = img->data;
+        return payload;
+    }
+
+    u32 *pixels = (u32*)malloc(payload.size);
+    LT_Assert(pixels);
+    for (i32 y = 0; y < height; y++)
+    {
+        for (i32 x = 0; x < width; x += img->tile_size)
+        {
+            const i32 count = lt_min((i32)img->tile_size, width - x);
+            memcpy(pixels + x + ((isize)y * width), img->data + lt_image_pixel_index(img, x, y), count * sizeof(u32));
+        }
+    }
+    payload.data = payload.buffer = pixels;
+    return payload;
+}
+
+// Texture texels can be in blocks and in any storage, so they are packed back into the
+// BGR bytes of the file. Texels are contiguous for a whole row in the linear layout and
+// for a block row in the blocked one.
+internal TGAPayload
+image_payload(const TGAImageRGB *img)
+{
+    LT_Assert(img->header.pixel_depth == TGAPixel_RGB);
+    const i32 width = img->header.image_width;
+    const i32 height = img->header.image_height;
+    const i32 span = (img->layout == TGALayout_Blocked) ? TGA_BLOCK_SIZE : width;
+
+    TGAPayload payload = {};
+    payload.size = (isize)width * height * 3;
+    u8 *bytes = (u8*)malloc(payload.size);
+    LT_Assert(bytes);
+
+    u8 *out = bytes;
+    for (i32 y = 0; y < height; y++)
+    {
+        for (i32 x = 0; x < width; x += span)
+        {
+            const isize first = lt_image_texel_index(img, 0, x, y);
+            const i32 count = lt_min(span, width - x);
+            for (i32 i = 0; i < count; i++, out += 3)
+            {
+                const u32 c = texel_load(img, first + i);
+                out[0] = c & 0xff;
+                out[1] = (c >> 8) & 0xff;
+                out[2] = (c >> 16) & 0xff;
+            }
+        }
+    }
+    payload.data = payload.buffer = bytes;
+    return payload;
 }
 
 internal void
-write_header(const TGAImageHeader *header, FILE* fp)
+encode_header(const TGAImageHeader *header, u8 *buf)
 {
     LT_Assert(lt_is_little_endian());
 
-    u8 buf[TGA_IMAGE_HEADER_SIZE];
-
     i32 offset = 0;
     memcpy(buf + offset, &header->id_length, sizeof(u8));
     offset = 1;
@@ -176,22 +377,12 @@ write_header(const TGAImageHeader *header, FILE* fp)
     memcpy(buf + offset, &header->pixel_depth, sizeof(u8));
     offset = 17;
     memcpy(buf + offset, &header->image_descriptor, sizeof(u8));
-
-    fwrite(buf, sizeof(u8), TGA_IMAGE_HEADER_SIZE, fp);
 }
 
 internal void
-load_header(TGAImageHeader *header, FILE* fd)
+decode_header(TGAImageHeader *header, const u8 *header_buf)
 {
     LT_Assert(lt_is_little_endian());
-    // Make sure that the descriptor is at the start of the file.
-    LT_Assert(fseek(fd, 0L, SEEK_SET) == 0);
-
-    const i32 num_elements_to_read = 1;
-    u8 header_buf[TGA_IMAGE_HEADER_SIZE] = {};
-    usize bytes_read = fread(header_buf, TGA_IMAGE_HEADER_SIZE, num_elements_to_read, fd);
-
-    LT_Assert(bytes_read == num_elements_to_read);
 
     i32 offset = 0;
     memcpy(&header->id_length, header_buf, sizeof(u8));
@@ -220,28 +411,136 @@ load_header(TGAImageHeader *header, FILE* fd)
 }
 
 internal void
-write_footer(const TGAImageFooter *footer, FILE* fp)
+encode_footer(const TGAImageFooter *footer, u8 *buf)
 {
-    fwrite(&footer->extension_area_offset, sizeof(u32), 1, fp);
-    fwrite(&footer->developer_dir_offset, sizeof(u32), 1, fp);
-    fwrite(footer->signature, sizeof(u8), 16, fp);
-    fwrite(&footer->reserved, sizeof(u8), 1, fp);
-    fwrite(&footer->zero_string_terminator, sizeof(u8), 1, fp);
+    LT_Assert(lt_is_little_endian());
+
+    i32 offset = 0;
+    memcpy(buf + offset, &footer->extension_area_offset, sizeof(u32));
+    offset += sizeof(u32);
+    memcpy(buf + offset, &footer->developer_dir_offset, sizeof(u32));
+    offset += sizeof(u32);
+    memcpy(buf + offset, footer->signature, 16);
+    offset += 16;
+    memcpy(buf + offset, &footer->reserved, 1);
+    offset += 1;
+    memcpy(buf + offset, &footer->zero_string_terminator, 1);
+}
+
+// Writes every part to the file, continuing after short writes.
+internal bool
+write_parts(i32 fd, struct iovec *parts, i32 num_parts)
+{
+    while (num_parts > 0)
+    {
+        ssize_t written = writev(fd, parts, num_parts);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+
+        while (num_parts > 0 && (usize)written >= parts->iov_len)
+        {
+            written -= parts->iov_len;
+            parts++;
+            num_parts--;
+        }
+        if (num_parts > 0)
+        {
+            parts->iov_base = (u8*)parts->iov_base + written;
+            parts->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+// A packet holds at most 128 pixels, and never goes past the end of a row.
+#define TGA_RLE_MAX_PACKET 128
+
+// Number of leading pixels of p, out of count, whose equality with the following pixel
+// is the requested one. Up to count + 1 pixels are read.
+internal i32
+rle_scan(const u8 *p, i32 count, i32 bpp, bool equal)
+{
+    i32 i = 0;
+#if defined(__SSE2__)
+    // Each byte is compared with the same byte of the next pixel, so a pixel equals the
+    // next one when all of its bytes do. The bytes of each pixel are folded into its
+    // first bit of the mask.
+    const i32 pixels_per_chunk = 16 / bpp;
+    const u32 first_bits = (bpp == 1) ? 0xffff : (bpp == 3) ? 0x1249 : (bpp == 4) ? 0x1111 : 0;
+    if (first_bits != 0)
+    {
+        for (; (count - i) * bpp >= 16; i += pixels_per_chunk)
+        {
+            const u8 *at = p + (i * bpp);
+            const __m128i a = _mm_loadu_si128((const __m128i*)at);
+            const __m128i b = _mm_loadu_si128((const __m128i*)(at + bpp));
+            const u32 bytes = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+            u32 pixels = bytes;
+            for (i32 k = 1; k < bpp; k++)
+                pixels &= bytes >> k;
+            pixels = (equal ? ~pixels : pixels) & first_bits;
+            if (pixels != 0)
+                return i + (__builtin_ctz(pixels) / bpp);
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        const bool same = memcmp(p + (i * bpp), p + ((i + 1) * bpp), bpp) == 0;
+        if (same != equal)
+            break;
+    }
+    return i;
+}
+
+// Encodes rows of pixels, already in the file format, as run length packets. Runs are
+// made of pixels equal to the next one, and raw packets stop right before a run starts.
+internal isize
+rle_encode(const u8 *pixels, i32 width, i32 height, i32 bpp, u8 *out)
+{
+    u8 *start = out;
+    for (i32 y = 0; y < height; y++)
+    {
+        const u8 *row = pixels + ((isize)y * width * bpp);
+        i32 x = 0;
+        while (x < width)
+        {
+            const u8 *at = row + (x * bpp);
+            const i32 pairs = width - 1 - x;
+
+            const i32 num_equal = rle_scan(at, lt_min(pairs, TGA_RLE_MAX_PACKET - 1), bpp, true);
+            if (num_equal > 0)
+            {
+                *out++ = 0x80 | (u8)num_equal;
+                memcpy(out, at, bpp);
+                out += bpp;
+                x += num_equal + 1;
+                continue;
+            }
+
+            const i32 max_pairs = lt_min(pairs, TGA_RLE_MAX_PACKET);
+            i32 num_raw = rle_scan(at, max_pairs, bpp, false);
+            // With no run before the end of the row, the last pixel goes in the packet too.
+            if (num_raw == max_pairs)
+                num_raw = lt_min(num_raw + 1, TGA_RLE_MAX_PACKET);
+
+            *out++ = (u8)(num_raw - 1);
+            memcpy(out, at, num_raw * bpp);
+            out += num_raw * bpp;
+            x += num_raw;
+        }
+    }
+    return out - start;
 }
 
 internal void
-load_footer(TGAImageFooter *footer, FILE* fd)
+decode_footer(TGAImageFooter *footer, const u8 *footer_buf)
 {
     LT_Assert(lt_is_little_endian());
 
-    u8 footer_buf[TGA_IMAGE_FOOTER_SIZE] = {};
-
-    // Go to the end of the file and go back the size of the footer.
-    // After read the size of the footer.
-    LT_Assert(fseek(fd, -TGA_IMAGE_FOOTER_SIZE, SEEK_END) == 0);
-    const i32 num_elements_to_read = 1;
-    usize bytes_read = fread(footer_buf, TGA_IMAGE_FOOTER_SIZE, num_elements_to_read, fd);
-    LT_Assert(bytes_read == num_elements_to_read);
     // Copy the buffer contents to the footer structure.
     i32 offset = 0;
     memcpy(&footer->extension_area_offset, footer_buf + offset, sizeof(u32));
@@ -260,7 +559,7 @@ initialize_header(TGAImageHeader *header, u16 width, u16 height, TGAPixel p)
 {
     header->id_length = 0;
     header->colormap_type = 0; // No color map is used.
-    header->image_type = 2;
+    header->image_type = (p == TGAPixel_Gray) ? TGAType_Uncompressed_BlackWhite : TGAType_Uncompressed_TrueColor;
 
     // This is related to colormap
     header->first_entry_index = 0;
@@ -311,104 +610,524 @@ lt_image_make_rgba(u16 width, u16 height)
     return img;
 }
 
-TGAImageRGB *
-lt_image_load_rgb(const char *filepath)
+// Number of pixels stored for the image, tiled images are padded to whole tiles.
+internal isize
+image_storage(const TGAImageRGBA *img)
 {
-    FILE *fd = fopen(filepath, "rb");
-    LT_Assert(fd);
+    if (img->tile_size == 0)
+        return (isize)img->header.image_width * img->header.image_height;
 
-    TGAImageRGB *img = (TGAImageRGB*)calloc(1, sizeof(*img));
-    load_header(&img->header, fd);
-    load_footer(&img->footer, fd);
+    const isize tiles_x = (img->header.image_width + img->tile_size - 1) / img->tile_size;
+    const isize tiles_y = (img->header.image_height + img->tile_size - 1) / img->tile_size;
+    return tiles_x * tiles_y * img->tile_size * img->tile_size;
+}
 
-    // NOTE(leo): This assertions facilitate the implementation, since I do not have to
-    // implement all of the possible image combinations.
-    LT_Assert(strncmp((const char*)img->footer.signature, "TRUEVISION-XFILE", 16) == 0);
-    LT_Assert(img->header.id_length == 0);
-    LT_Assert(img->header.pixel_depth == TGAPixel_RGB);
-    LT_Assert((img->header.image_descriptor & (0x03 << 4)) == 0);
+TGAImageRGBA *
+lt_image_make_rgba_tiled(u16 width, u16 height, u16 tile_size)
+{
+    LT_Assert(tile_size > 0);
+    TGAImageRGBA *img = (TGAImageRGBA*)calloc(1, sizeof(*img));
 
-    switch (img->header.image_type)
-    {
-    case TGAType_RunLength_TrueColor:
+    initialize_header(&img->header, width, height, TGAPixel_RGBA);
+    img->tile_size = tile_size;
+    img->data = (u32*)calloc(image_storage(img),  sizeof(u32));
+    initialize_footer(&img->footer);
+
+    return img;
+}
+
+internal inline i32
+level_dimension(i32 size, i32 level)
+{
+    return lt_max(size >> level, 1);
+}
+
+// Number of texels stored for a level, blocked levels are padded to whole blocks.
+internal inline isize
+level_storage(i32 w, i32 h, TGALayout layout)
+{
+    if (layout == TGALayout_Blocked)
     {
-        LT_Assert(img->header.colormap_type == 0);
+        const isize blocks_x = (w + TGA_BLOCK_SIZE - 1) / TGA_BLOCK_SIZE;
+        const isize blocks_y = (h + TGA_BLOCK_SIZE - 1) / TGA_BLOCK_SIZE;
+        return blocks_x * blocks_y * TGA_BLOCK_SIZE * TGA_BLOCK_SIZE;
+    }
+    return (isize)w * h;
+}
 
-        // Seek descriptor to the correct position.
-        u32 colormap_size = img->header.colormap_entry_size * img->header.colormap_length;
-        LT_Assert(fseek(fd, TGA_IMAGE_HEADER_SIZE + img->header.id_length + colormap_size, SEEK_SET) == 0);
+// Stores the linear pixels read from the file in the requested layout and storage, then
+// builds every mipmap level down to 1x1 with a box filter. The levels are stored after
+// the full image, so they share its allocation and are freed with it.
+internal void
+generate_mipmaps(TGAImageRGB *img, const u32 *linear, TGALayout layout, TGAStorage storage)
+{
+    const i32 width = img->header.image_width;
+    const i32 height = img->header.image_height;
 
-        usize image_data_length = img->header.image_width*img->header.image_height;
-        img->data = (u32*)calloc(image_data_length, sizeof(u32));
+    isize total_texels = 0;
+    img->num_levels = 0;
+    for (;;)
+    {
+        const i32 w = level_dimension(width, img->num_levels);
+        const i32 h = level_dimension(height, img->num_levels);
+        LT_Assert(img->num_levels < TGA_IMAGE_MAX_LEVELS);
+        img->level_offsets[img->num_levels++] = total_texels;
+        total_texels += level_storage(w, h, layout);
+        if (w == 1 && h == 1)
+            break;
+    }
 
-        // NOTE(leo): A run-length encoded packed is composed of two fields.
-        // RepetitionCount (first byte):
-        //    - 1st bit: 1 = run-length encoded packet, 0 = raw packet.
-        //    - 7 bits left: number of pixels - 1. Always add 1 to get the real number of pixels.
-        // PixelValue (variable):
-        //    - The actual pixel values. If it is a raw packet, it will contain N pixels.
-        //    - If it is run-length encoded, it will contain only one pixel, but repeated based on the 7 bits from
-        //    the header.
-        const u32 MAX_PIXELS = 0x7f + 1; // 128
-        RepetitionCount header;
-        u8 pixel_value[MAX_PIXELS * 3];
+    // Levels start at whole blocks, so with a cache line aligned base every RGBA8 block
+    // is exactly one cache line.
+    const isize bytes_per_texel = (storage == TGAStorage_RGBA8) ? sizeof(u32) : 3;
+    void *data = NULL;
+    if (posix_memalign(&data, TGA_TEXTURE_ALIGNMENT, total_texels * bytes_per_texel) != 0)
+        LT_Fail("Could not allocate memory for the mipmaps\n");
+    memset(data, 0, total_texels * bytes_per_texel);
+    img->data = (u8*)data;
+    img->layout = layout;
+    img->storage = storage;
+    img->num_texels = total_texels;
+
+    for (i32 y = 0; y < height; y++)
+        for (i32 x = 0; x < width; x++)
+            texel_store(img, lt_image_texel_index(img, 0, x, y), linear[x + (y * width)]);
+
+    for (i32 level = 1; level < img->num_levels; level++)
+    {
+        const i32 src_w = level_dimension(width, level - 1);
+        const i32 src_h = level_dimension(height, level - 1);
+        const i32 dst_w = level_dimension(width, level);
+        const i32 dst_h = level_dimension(height, level);
 
-        isize image_data_pixel = 0;
-        while (image_data_pixel < image_data_length)
+        for (i32 y = 0; y < dst_h; y++)
         {
-            // Clear buffer at the start of the iteration.
-            memset(pixel_value, 0, MAX_PIXELS * 3);
-
-            i32 c = getc(fd);
-            LT_Assert(c != EOF);
-
-            header = c;
-            const bool run_length_packet = ((header >> 7) == 1);
-            const isize num_pixels = (header & 0x7f) + 1;
-            const isize until_pixel = image_data_pixel + num_pixels;
-            LT_Assert(num_pixels <= MAX_PIXELS);
-            if (run_length_packet)
+            // Odd sizes repeat the last row and column of the bigger level.
+            const i32 y0 = lt_min(y * 2, src_h - 1);
+            const i32 y1 = lt_min((y * 2) + 1, src_h - 1);
+            for (i32 x = 0; x < dst_w; x++)
             {
-                LT_Assert(fread(pixel_value, 3, 1, fd) == 1);
-                // Copy the data from pixel_value to image data.
-                for (; image_data_pixel < until_pixel; image_data_pixel++)
-                    memcpy(&img->data[image_data_pixel], pixel_value, 3);
+                const i32 x0 = lt_min(x * 2, src_w - 1);
+                const i32 x1 = lt_min((x * 2) + 1, src_w - 1);
+                const u32 c = average_texels(texel_load(img, lt_image_texel_index(img, level - 1, x0, y0)),
+                                             texel_load(img, lt_image_texel_index(img, level - 1, x1, y0)),
+                                             texel_load(img, lt_image_texel_index(img, level - 1, x0, y1)),
+                                             texel_load(img, lt_image_texel_index(img, level - 1, x1, y1)));
+                texel_store(img, lt_image_texel_index(img, level, x, y), c);
             }
-            else
+        }
+    }
+}
+
+/* ---------------------------------------------------------------
+                      Loading
+ * --------------------------------------------------------------- */
+
+// How the pixels of a file are read: their size, and for color mapped files the
+// palette that their indexes point to, already converted to image pixels.
+template<typename T>
+struct TGASource {
+    i32         depth;
+    i32         bytes_per_pixel;
+    const T    *palette;
+    i32         first_entry;
+    i32         num_entries;
+};
+
+// Color of a pixel of the file as 0xAARRGGBB. Pixels without alpha are opaque, and the
+// attribute bit of 16 bit pixels is ignored.
+internal inline u32
+file_color(const u8 *p, i32 depth)
+{
+    switch (depth)
+    {
+    case 8:
+        return 0xff000000 | (p[0] << 16) | (p[0] << 8) | p[0];
+    case 15:
+    case 16:
+    {
+        const u32 v = p[0] | (p[1] << 8);
+        const u32 r = (v >> 10) & 0x1f;
+        const u32 g = (v >> 5) & 0x1f;
+        const u32 b = v & 0x1f;
+        return 0xff000000 | (((r << 3) | (r >> 2)) << 16) | (((g << 3) | (g >> 2)) << 8) | ((b << 3) | (b >> 2));
+    }
+    case 24:
+        return 0xff000000 | (p[2] << 16) | (p[1] << 8) | p[0];
+    case 32:
+        return ((u32)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+    default:
+        LT_Fail("Unsupported pixel depth %d\n", depth);
+        return 0;
+    }
+}
+
+internal inline void
+convert_pixel(const u8 *p, i32 depth, u32 *out)
+{
+    *out = file_color(p, depth);
+}
+
+// Color pixels are stored in gray images by their luma.
+internal inline void
+convert_pixel(const u8 *p, i32 depth, u8 *out)
+{
+    if (depth == 8)
+    {
+        *out = p[0];
+        return;
+    }
+    const u32 c = file_color(p, depth);
+    *out = (u8)(((((c >> 16) & 0xff) * 77) + (((c >> 8) & 0xff) * 150) + ((c & 0xff) * 29)) >> 8);
+}
+
+template<typename T> internal inline T
+source_pixel(const TGASource<T> *src, const u8 *p)
+{
+    T pixel = 0;
+    if (src->palette)
+    {
+        const i32 index = ((src->bytes_per_pixel == 1) ? p[0] : (p[0] | (p[1] << 8))) - src->first_entry;
+        if (index >= 0 && index < src->num_entries)
+            pixel = src->palette[index];
+    }
+    else
+    {
+        convert_pixel(p, src->depth, &pixel);
+    }
+    return pixel;
+}
+
+template<typename T> internal inline void
+fill_pixels(T *out, isize count, T pixel)
+{
+    for (isize i = 0; i < count; i++)
+        out[i] = pixel;
+}
+
+// Color pixels are filled a whole register at a time.
+internal inline void
+fill_pixels(u32 *out, isize count, u32 pixel)
+{
+    isize i = 0;
+#if defined(__SSE2__)
+    const __m128i pixels = _mm_set1_epi32(pixel);
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_si128((__m128i*)(out + i), pixels);
+#endif
+    for (; i < count; i++)
+        out[i] = pixel;
+}
+
+// Expands count BGR pixels of the file into opaque 0xAARRGGBB pixels. With SSSE3 four
+// pixels are moved into their lanes by a single shuffle, while the 16 byte load stays
+// before the end of the data.
+internal inline void
+expand_rgb(const u8 *in, const u8 *end, u32 *out, isize count)
+{
+    isize i = 0;
+#if defined(__SSSE3__)
+    const __m128i lanes = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    for (; (i + 4 <= count) && (end - (in + (i * 3)) >= 16); i += 4)
+    {
+        const __m128i bytes = _mm_loadu_si128((const __m128i*)(in + (i * 3)));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(_mm_shuffle_epi8(bytes, lanes), alpha));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        const u8 *pixel = in + (i * 3);
+        out[i] = 0xff000000 | (pixel[0] | (pixel[1] << 8) | (pixel[2] << 16));
+    }
+}
+
+template<typename T> internal inline void
+convert_span(const TGASource<T> *src, const u8 *in, const u8 *end, T *out, isize count)
+{
+    (void)end;
+    for (isize i = 0; i < count; i++)
+        out[i] = source_pixel(src, in + (i * src->bytes_per_pixel));
+}
+
+// 24 bit pixels, the usual ones for textures, are expanded with SIMD.
+internal inline void
+convert_span(const TGASource<u32> *src, const u8 *in, const u8 *end, u32 *out, isize count)
+{
+    if (src->depth == 24 && !src->palette)
+        expand_rgb(in, end, out, count);
+    else
+        convert_span<u32>(src, in, end, out, count);
+}
+
+// NOTE(leo): A run-length encoded packed is composed of two fields.
+// RepetitionCount (first byte):
+//    - 1st bit: 1 = run-length encoded packet, 0 = raw packet.
+//    - 7 bits left: number of pixels - 1. Always add 1 to get the real number of pixels.
+// PixelValue (variable):
+//    - The actual pixel values. If it is a raw packet, it will contain N pixels.
+//    - If it is run-length encoded, it will contain only one pixel, but repeated based on the 7 bits from
+//    the header.
+//
+// Returns false if the data ends before all of the pixels are decoded, or if a packet
+// goes past the last pixel.
+template<typename T> internal bool
+decode_run_length(const TGASource<T> *src, const u8 *at, const u8 *end, T *out, isize num_pixels)
+{
+    const isize bpp = src->bytes_per_pixel;
+    const T *out_end = out + num_pixels;
+    while (out < out_end)
+    {
+        if (at >= end)
+            return false;
+
+        const RepetitionCount header = *at++;
+        const isize count = (header & 0x7f) + 1;
+        if (count > out_end - out)
+            return false;
+
+        if (header & 0x80)
+        {
+            if (end - at < bpp)
+                return false;
+            fill_pixels(out, count, source_pixel(src, at));
+            at += bpp;
+        }
+        else
+        {
+            if (end - at < count * bpp)
+                return false;
+            convert_span(src, at, end, out, count);
+            at += count * bpp;
+        }
+        out += count;
+    }
+    return true;
+}
+
+template<typename T> internal bool
+decode_uncompressed(const TGASource<T> *src, const u8 *at, const u8 *end, T *out, isize num_pixels)
+{
+    if (end - at < num_pixels * src->bytes_per_pixel)
+        return false;
+    convert_span(src, at, end, out, num_pixels);
+    return true;
+}
+
+// Puts the pixels, decoded in file order, with the first row at the bottom and the
+// first pixel of a row on the left.
+template<typename T> internal void
+flip_to_bottom_left(T *pixels, i32 width, i32 height, bool top, bool right)
+{
+    if (top)
+    {
+        T *row = (T*)malloc(width * sizeof(T));
+        LT_Assert(row);
+        for (i32 y = 0; y < height / 2; y++)
+        {
+            T *a = pixels + ((isize)y * width);
+            T *b = pixels + ((isize)(height - 1 - y) * width);
+            memcpy(row, a, width * sizeof(T));
+            memcpy(a, b, width * sizeof(T));
+            memcpy(b, row, width * sizeof(T));
+        }
+        free(row);
+    }
+    if (right)
+    {
+        for (i32 y = 0; y < height; y++)
+        {
+            T *row = pixels + ((isize)y * width);
+            for (i32 x = 0; x < width / 2; x++)
             {
-                LT_Assert(fread(pixel_value, 3, num_pixels, fd) == num_pixels);
-                for (isize pixel_i = 0; pixel_i < num_pixels*3; pixel_i+=3)
-                {
-                    memcpy(&img->data[image_data_pixel], pixel_value + pixel_i, 3);
-                    image_data_pixel++;
-                }
+                const T pixel = row[x];
+                row[x] = row[width - 1 - x];
+                row[width - 1 - x] = pixel;
             }
         }
-    } break;
-    default:
-        LT_Fail("Case not yet implemented.");
     }
+}
 
-    img->header.image_type = TGAType_Uncompressed_TrueColor;
-    fclose(fd);
+// Loads a TGA file of any type but the obsolete compressed ones (32 and 33): true color,
+// grayscale and color mapped, uncompressed or run length encoded, with 8, 15, 16, 24
+// or 32 bit pixels and any origin. The pixels are converted to T, u8 for grayscale or
+// u32 for color, so the image header describes the converted pixels and not the file.
+template<typename T> TGAImage<T> *
+lt_image_load(const char *filepath)
+{
+    static_assert(sizeof(T) == TGAPixel_Gray/8 || sizeof(T) == TGAPixel_RGBA/8, "u8 or u32 pixels");
+
+    FileMapping *file = file_map(filepath);
+    if (file->error != FileError_None)
+    {
+        LT_Fail("Failed to open %s\n", filepath);
+    }
+    LT_Assert(file->size >= TGA_IMAGE_HEADER_SIZE);
+
+    const u8 *begin = (const u8*)file->data;
+    const u8 *end = begin + file->size;
+
+    TGAImageHeader file_header;
+    decode_header(&file_header, begin);
+
+    TGAImage<T> *img = (TGAImage<T>*)calloc(1, sizeof(*img));
+    initialize_header(&img->header, file_header.image_width, file_header.image_height,
+                      (sizeof(T) == 1) ? TGAPixel_Gray : TGAPixel_RGBA);
+
+    // Files without the footer are from the first version of the format.
+    const u8 *data_end = end;
+    if (file->size >= TGA_IMAGE_HEADER_SIZE + TGA_IMAGE_FOOTER_SIZE &&
+        memcmp(end - TGA_IMAGE_FOOTER_SIZE + 8, "TRUEVISION-XFILE", 16) == 0)
+    {
+        decode_footer(&img->footer, end - TGA_IMAGE_FOOTER_SIZE);
+        data_end = end - TGA_IMAGE_FOOTER_SIZE;
+    }
+    else
+    {
+        initialize_footer(&img->footer);
+    }
+
+    const bool color_mapped = file_header.image_type == TGAType_Uncompressed_ColorMapped ||
+                              file_header.image_type == TGAType_RunLength_ColorMapped;
+    const bool run_length = file_header.image_type == TGAType_RunLength_ColorMapped ||
+                            file_header.image_type == TGAType_RunLength_TrueColor ||
+                            file_header.image_type == TGAType_RunLength_BlackWhite;
+    const bool gray = file_header.image_type == TGAType_Uncompressed_BlackWhite ||
+                      file_header.image_type == TGAType_RunLength_BlackWhite;
+
+    TGASource<T> src = {};
+    src.depth = file_header.pixel_depth;
+    src.bytes_per_pixel = (file_header.pixel_depth + 7) / 8;
+
+    const u8 *colormap = begin + TGA_IMAGE_HEADER_SIZE + file_header.id_length;
+    const i32 entry_size = (file_header.colormap_entry_size + 7) / 8;
+    const isize colormap_size = (file_header.colormap_type == 1) ? (isize)entry_size * file_header.colormap_length : 0;
+    const u8 *data = colormap + colormap_size;
+    LT_Assert(data <= data_end);
+
+    T *palette = NULL;
+    if (color_mapped)
+    {
+        LT_Assert(file_header.colormap_type == 1);
+        LT_Assert(src.depth == 8 || src.depth == 16);
+        palette = (T*)malloc(lt_max((isize)file_header.colormap_length, (isize)1) * sizeof(T));
+        for (i32 i = 0; i < file_header.colormap_length; i++)
+            convert_pixel(colormap + (i * entry_size), file_header.colormap_entry_size, &palette[i]);
+        src.palette = palette;
+        src.first_entry = file_header.first_entry_index;
+        src.num_entries = file_header.colormap_length;
+    }
+    else if (gray)
+    {
+        LT_Assert(src.depth == 8);
+    }
+    else if (file_header.image_type == TGAType_Uncompressed_TrueColor ||
+             file_header.image_type == TGAType_RunLength_TrueColor)
+    {
+        LT_Assert(src.depth == 15 || src.depth == 16 || src.depth == 24 || src.depth == 32);
+    }
+    else
+    {
+        LT_Fail("Image type %d is not supported.\n", file_header.image_type);
+    }
+
+    const i32 width = file_header.image_width;
+    const i32 height = file_header.image_height;
+    const isize num_pixels = (isize)width * height;
+    img->data = (T*)calloc(lt_max(num_pixels, (isize)1), sizeof(T));
+
+    const bool decoded = run_length
+        ? decode_run_length(&src, data, data_end, img->data, num_pixels)
+        : decode_uncompressed(&src, data, data_end, img->data, num_pixels);
+    if (!decoded)
+    {
+        LT_Fail("Truncated image data in %s\n", filepath);
+    }
+
+    flip_to_bottom_left(img->data, width, height,
+                        (file_header.image_descriptor & (1 << 5)) != 0,
+                        (file_header.image_descriptor & (1 << 4)) != 0);
+
+    free(palette);
+    file_unmap(file);
     return img;
 }
 
+// Textures are loaded as color images, then moved into the requested layout and storage
+// with their mipmaps.
+TGAImageRGB *
+lt_image_load_rgb(const char *filepath, TGALayout layout, TGAStorage storage)
+{
+    TGAImageRGBA *pixels = lt_image_load<u32>(filepath);
+
+    TGAImageRGB *img = (TGAImageRGB*)calloc(1, sizeof(*img));
+    initialize_header(&img->header, pixels->header.image_width, pixels->header.image_height, TGAPixel_RGB);
+    img->header.image_descriptor = 0;
+    img->footer = pixels->footer;
+
+    generate_mipmaps(img, pixels->data, layout, storage);
+    lt_image_free(pixels);
+    return img;
+}
+
+// The pixels are converted to the file format in one pass and the whole file is then
+// written with a single writev of the header, the pixels and the footer. Compressed
+// files are encoded from the converted pixels.
 template<typename T> void
-lt_image_write_to_file(const T *img, const char *filepath)
+lt_image_write_to_file(const T *img, const char *filepath, TGACompression compression)
 {
-    FILE* fp = fopen(filepath, "w");
-    if (!fp)
+    TGAImageHeader file_header = img->header;
+    TGAPayload payload = image_payload(img);
+
+    if (compression == TGACompression_RunLength)
+    {
+        const i32 width = img->header.image_width;
+        const i32 height = img->header.image_height;
+        const i32 bpp = img->header.pixel_depth / 8;
+        // A run packet is never bigger than its pixels, so at worst there is one raw
+        // packet header for every pixel.
+        u8 *encoded = (u8*)malloc(payload.size + ((isize)width * height));
+        LT_Assert(encoded);
+
+        TGAPayload compressed = {};
+        compressed.size = rle_encode((const u8*)payload.data, width, height, bpp, encoded);
+        compressed.data = compressed.buffer = encoded;
+        free(payload.buffer);
+        payload = compressed;
+
+        file_header.image_type = (img->header.pixel_depth == TGAPixel_Gray)
+            ? TGAType_RunLength_BlackWhite
+            : TGAType_RunLength_TrueColor;
+    }
+
+    u8 header[TGA_IMAGE_HEADER_SIZE];
+    u8 footer[TGA_IMAGE_FOOTER_SIZE];
+    encode_header(&file_header, header);
+    encode_footer(&img->footer, footer);
+
+    i32 fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
     {
         printf("Could not open %s", filepath);
         abort();
     }
 
-    write_header(&img->header, fp);
-    write_image_data(img, fp);
-    write_footer(&img->footer, fp);
+    struct iovec parts[3];
+    parts[0].iov_base = header;
+    parts[0].iov_len = TGA_IMAGE_HEADER_SIZE;
+    parts[1].iov_base = (void*)payload.data;
+    parts[1].iov_len = payload.size;
+    parts[2].iov_base = footer;
+    parts[2].iov_len = TGA_IMAGE_FOOTER_SIZE;
 
-    fclose(fp);
+    if (!write_parts(fd, parts, 3))
+    {
+        printf("Could not write %s", filepath);
+        abort();
+    }
+
+    free(payload.buffer);
+    close(fd);
 }
 
 void
@@ -421,8 +1140,9 @@ lt_image_fill(TGAImageGray *img, u8 gray)
 void
 lt_image_fill(TGAImageRGBA *img, const Vec4i c)
 {
-    for (isize i = 0; i < img->header.image_width * img->header.image_height; i++)
-        img->data[i] = pack_rgba(c);
+    const u32 color = pack_rgba(c);
+    for (isize i = 0; i < image_storage(img); i++)
+        img->data[i] = color;
 }
 
 void
@@ -444,10 +1164,20 @@ lt_image_set(TGAImageRGBA *img, u16 x, u16 y, const Vec4i shade)
     LT_Assert(x < img->header.image_width);
     LT_Assert(y < img->header.image_height);
 
-    u32 index = (y * img->header.image_width) + x;
-    LT_Assert(index < (u32)img->header.image_height * (u32)img->header.image_width);
+    img->data[lt_image_pixel_index(img, x, y)] = pack_rgba(shade);
+}
+
+// Index of the pixel (x, y) in the image data.
+isize
+lt_image_pixel_index(const TGAImageRGBA *img, i32 x, i32 y)
+{
+    const i32 tile_size = img->tile_size;
+    if (tile_size == 0)
+        return x + ((isize)y * img->header.image_width);
 
-    img->data[index] = pack_rgba(shade);
+    const i32 tiles_x = (img->header.image_width + tile_size - 1) / tile_size;
+    const isize tile = (x / tile_size) + ((y / tile_size) * tiles_x);
+    return (tile * tile_size * tile_size) + (x % tile_size) + ((y % tile_size) * tile_size);
 }
 
 Vec3i
@@ -457,10 +1187,88 @@ lt_image_get(TGAImageRGB  *img, u16 x, u16 y)
     LT_Assert(x < img->header.image_width);
     LT_Assert(y < img->header.image_height);
 
-    u32 index = (y * img->header.image_width) + x;
-    LT_Assert(index < (u32)img->header.image_height * (u32)img->header.image_width);
+    return unpack_rgb(texel_load(img, lt_image_texel_index(img, 0, x, y)) & 0x00ffffff);
+}
+
+// Index of the texel (x, y) of a mipmap level in the image data.
+isize
+lt_image_texel_index(const TGAImageRGB *img, i32 level, i32 x, i32 y)
+{
+    LT_Assert(level < img->num_levels);
+
+    const i32 w = level_dimension(img->header.image_width, level);
+    if (img->layout == TGALayout_Blocked)
+    {
+        const i32 blocks_x = (w + TGA_BLOCK_SIZE - 1) / TGA_BLOCK_SIZE;
+        const isize block = (x / TGA_BLOCK_SIZE) + ((y / TGA_BLOCK_SIZE) * blocks_x);
+        const isize in_block = (x % TGA_BLOCK_SIZE) + ((y % TGA_BLOCK_SIZE) * TGA_BLOCK_SIZE);
+        return img->level_offsets[level] + (block * TGA_BLOCK_SIZE * TGA_BLOCK_SIZE) + in_block;
+    }
+    return img->level_offsets[level] + x + ((isize)y * w);
+}
+
+// Nearest texel at the normalized coordinates (u, v), clamped to the edges. The texel
+// is returned packed as 0xAARRGGBB.
+u32
+lt_image_sample(const TGAImageRGB *img, f32 u, f32 v)
+{
+    const i32 max_x = img->header.image_width - 1;
+    const i32 max_y = img->header.image_height - 1;
+
+    // Same as lt_image_get(img, u*max_x, v*max_y), but never outside of the image.
+    i32 x = (i32)(lt_max(lt_min(u, 1.0f), 0.0f) * max_x);
+    i32 y = (i32)(lt_max(lt_min(v, 1.0f), 0.0f) * max_y);
+
+    return texel_load(img, lt_image_texel_index(img, 0, x, y));
+}
+
+// Bilinear filtered texel of a mipmap level, interpolated on the u8 lanes of the texels
+// with weights in 256ths.
+internal u32
+sample_bilinear(const TGAImageRGB *img, i32 level, f32 u, f32 v)
+{
+    const i32 w = level_dimension(img->header.image_width, level);
+    const i32 h = level_dimension(img->header.image_height, level);
+
+    // Texel centers are at half integers.
+    const f32 fx = (lt_max(lt_min(u, 1.0f), 0.0f) * w) - 0.5f;
+    const f32 fy = (lt_max(lt_min(v, 1.0f), 0.0f) * h) - 0.5f;
+    const f32 floor_x = floorf(fx);
+    const f32 floor_y = floorf(fy);
+    const u32 tx = (u32)((fx - floor_x) * 256.0f);
+    const u32 ty = (u32)((fy - floor_y) * 256.0f);
+
+    // Both neighbours are clamped from the unclamped floor, so half a texel from the
+    // edge the sample stays on the edge texel.
+    const i32 x0 = lt_min(lt_max((i32)floor_x, 0), w - 1);
+    const i32 y0 = lt_min(lt_max((i32)floor_y, 0), h - 1);
+    const i32 x1 = lt_min(lt_max((i32)floor_x + 1, 0), w - 1);
+    const i32 y1 = lt_min(lt_max((i32)floor_y + 1, 0), h - 1);
+
+    const u32 t00 = texel_load(img, lt_image_texel_index(img, level, x0, y0));
+    const u32 t10 = texel_load(img, lt_image_texel_index(img, level, x1, y0));
+    const u32 t01 = texel_load(img, lt_image_texel_index(img, level, x0, y1));
+    const u32 t11 = texel_load(img, lt_image_texel_index(img, level, x1, y1));
+
+    return lerp_texels(lerp_texels(t00, t10, tx), lerp_texels(t01, t11, tx), ty);
+}
+
+// Trilinear filtered texel at the normalized coordinates (u, v). The level of detail
+// is the log2 of the texture footprint of the pixel, in texels of the full image. The
+// texel is returned packed as 0xAARRGGBB.
+u32
+lt_image_sample_trilinear(const TGAImageRGB *img, f32 u, f32 v, f32 lod)
+{
+    LT_Assert(img->num_levels > 0);
+
+    lod = lt_max(lt_min(lod, (f32)(img->num_levels - 1)), 0.0f);
+    const i32 level = (i32)lod;
+    const u32 t = (u32)((lod - level) * 256.0f);
 
-    return unpack_rgb(img->data[index]);
+    const u32 c = sample_bilinear(img, level, u, v);
+    if (t == 0)
+        return c;
+    return lerp_texels(c, sample_bilinear(img, level + 1, u, v), t);
 }
 
 template<typename T> i32 lt_image_height(T *img) {return img->header.image_height;}
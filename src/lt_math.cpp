@@ -2,6 +2,12 @@
 #include <math.h>
 #include <stdio.h>
 
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#elif defined(__SSE__)
+#  include <xmmintrin.h>
+#endif
+
 /////////////////////////////////////////////////////////
 //
 // Vector implementation
@@ -15,6 +21,7 @@ Vec3f::Vec3f(f32 x, f32 y, f32 z) : x(x), y(y), z(z) {}
 Vec4i::Vec4i() {}
 Vec4i::Vec4i(i32 x, i32 y, i32 z, i32 w) : x(x), y(y), z(z), w(w) {}
 
+Mat4::Mat4() {}
 Mat4::Mat4(f32 m00, f32 m01, f32 m02, f32 m03,
            f32 m10, f32 m11, f32 m12, f32 m13,
            f32 m20, f32 m21, f32 m22, f32 m23,
@@ -59,3 +66,97 @@ Mat4 mat4_look_at(const Vec3f eye, const Vec3f center, const Vec3f up) {
                 -f.x,  -f.y,  -f.z,  vec_dot(f, eye),
                  0.0f,  0.0f,  0.0f,       1.0f    );
 }
+
+Mat4 mat4_mul(const Mat4 a, const Mat4 b) {
+    Mat4 r;
+    for (i32 row = 0; row < 4; row++)
+        for (i32 col = 0; col < 4; col++)
+            r.m[row][col] = (a.m[row][0] * b.m[0][col]) + (a.m[row][1] * b.m[1][col]) +
+                            (a.m[row][2] * b.m[2][col]) + (a.m[row][3] * b.m[3][col]);
+    return r;
+}
+
+void
+mat4_transform_points(const Mat4 m, const f32 *x, const f32 *y, const f32 *z, isize count,
+                      f32 width, f32 height,
+                      f32 *out_x, f32 *out_y, f32 *out_z, f32 *out_inv_w)
+{
+    const f32 half_width = width * 0.5f;
+    const f32 half_height = height * 0.5f;
+    isize i = 0;
+
+#if defined(__AVX2__)
+    // Every matrix element is broadcast to a whole register, so each lane works on
+    // a different point.
+    __m256 e[4][4];
+    for (i32 row = 0; row < 4; row++)
+        for (i32 col = 0; col < 4; col++)
+            e[row][col] = _mm256_set1_ps(m.m[row][col]);
+
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 half_width_x8 = _mm256_set1_ps(half_width);
+    const __m256 half_height_x8 = _mm256_set1_ps(half_height);
+
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256 px = _mm256_loadu_ps(x + i);
+        const __m256 py = _mm256_loadu_ps(y + i);
+        const __m256 pz = _mm256_loadu_ps(z + i);
+
+        __m256 c[4];
+        for (i32 row = 0; row < 4; row++)
+        {
+            c[row] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e[row][0], px), _mm256_mul_ps(e[row][1], py)),
+                                   _mm256_add_ps(_mm256_mul_ps(e[row][2], pz), e[row][3]));
+        }
+
+        const __m256 inv_w = _mm256_div_ps(one, c[3]);
+        _mm256_storeu_ps(out_x + i, _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(c[0], inv_w), one), half_width_x8));
+        _mm256_storeu_ps(out_y + i, _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(c[1], inv_w), one), half_height_x8));
+        _mm256_storeu_ps(out_z + i, _mm256_mul_ps(c[2], inv_w));
+        _mm256_storeu_ps(out_inv_w + i, inv_w);
+    }
+#elif defined(__SSE__)
+    __m128 e[4][4];
+    for (i32 row = 0; row < 4; row++)
+        for (i32 col = 0; col < 4; col++)
+            e[row][col] = _mm_set1_ps(m.m[row][col]);
+
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 half_width_x4 = _mm_set1_ps(half_width);
+    const __m128 half_height_x4 = _mm_set1_ps(half_height);
+
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128 px = _mm_loadu_ps(x + i);
+        const __m128 py = _mm_loadu_ps(y + i);
+        const __m128 pz = _mm_loadu_ps(z + i);
+
+        __m128 c[4];
+        for (i32 row = 0; row < 4; row++)
+        {
+            c[row] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e[row][0], px), _mm_mul_ps(e[row][1], py)),
+                                _mm_add_ps(_mm_mul_ps(e[row][2], pz), e[row][3]));
+        }
+
+        const __m128 inv_w = _mm_div_ps(one, c[3]);
+        _mm_storeu_ps(out_x + i, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(c[0], inv_w), one), half_width_x4));
+        _mm_storeu_ps(out_y + i, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(c[1], inv_w), one), half_height_x4));
+        _mm_storeu_ps(out_z + i, _mm_mul_ps(c[2], inv_w));
+        _mm_storeu_ps(out_inv_w + i, inv_w);
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        f32 c[4];
+        for (i32 row = 0; row < 4; row++)
+            c[row] = ((m.m[row][0] * x[i]) + (m.m[row][1] * y[i])) + ((m.m[row][2] * z[i]) + m.m[row][3]);
+
+        const f32 inv_w = 1.0f / c[3];
+        out_x[i] = ((c[0] * inv_w) + 1.0f) * half_width;
+        out_y[i] = ((c[1] * inv_w) + 1.0f) * half_height;
+        out_z[i] = c[2] * inv_w;
+        out_inv_w[i] = inv_w;
+    }
+}
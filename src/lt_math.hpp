@@ -85,6 +85,7 @@ inline Vec2i operator-(const Vec2i v) {return Vec2i(-v.x, -v.y);}
 inline Vec3f operator-(const Vec3f a, const Vec3f b) {return Vec3f(a.x-b.x, a.y-b.y, a.z-b.z);}
 inline Vec3f operator+(const Vec3f a, const Vec3f b) {return Vec3f(a.x+b.x, a.y+b.y, a.z+b.z);}
 inline Vec3f operator-(const Vec3f v) {return Vec3f(-v.x, -v.y, -v.z);}
+inline Vec3f operator*(const Vec3f v, const f32 k) {return Vec3f(v.x * k, v.y * k, v.z * k);}
 inline f32 vec_len(const Vec3f v) {return sqrt(v.x*v.x + v.y*v.y + v.z*v.z);}
 
 inline i32 vec_dot(const Vec2i a, const Vec2i b) {return (a.x * b.x) + (a.y * b.y);}
@@ -143,4 +144,13 @@ union Mat4 {
 Mat4 mat4_identity   ();
 Mat4 mat4_perspective(f32 fovy, f32 aspect_ratio, f32 znear, f32 zfar);
 Mat4 mat4_look_at    (const Vec3f eye, const Vec3f center, const Vec3f up);
+Mat4 mat4_mul        (const Mat4 a, const Mat4 b);
+
+// Transforms count points, given as separate x, y and z streams with w = 1, divides
+// them by w and maps them from [-1, 1] to [0, width] and [0, height]. The depth is
+// left in [-1, 1] and 1/w is written to out_inv_w, for perspective correction.
+// Eight points are transformed at a time with AVX2, four with SSE.
+void mat4_transform_points(const Mat4 m, const f32 *x, const f32 *y, const f32 *z, isize count,
+                           f32 width, f32 height,
+                           f32 *out_x, f32 *out_y, f32 *out_z, f32 *out_inv_w);
 #endif // LT_MATH_HPP
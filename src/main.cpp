@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
-#include <limits.h>
+#include <float.h>
+#include <math.h>
 
 #define LT_IMPLEMENTATION
 #include "lt.hpp"
@@ -11,193 +12,2372 @@
 #define IMAGE_WIDTH  800
 #define IMAGE_HEIGHT 768
 
+// Side of the square screen tiles that are rasterized independently by each thread.
+#define TILE_SIZE 64
+
+// Rasterize into a visibility buffer and shade every pixel once in a second pass,
+// instead of shading every fragment that passes the depth test.
+#define VISIBILITY_BUFFER_MODE 1
+
+// Reorder the faces of loaded meshes for the vertex cache and for less overdraw. The
+// reordered faces are saved in the mesh cache.
+#define OPTIMIZE_MESH 1
+
 
 // TODO(leo): this is far from complete.
 struct ObjFile
 {
-    Array<Vec3f> vertices;
-    Array<Vec3f> tex_coords;
-    Array<Vec3i> faces_vertices;
-    Array<Vec3i> faces_textures;
-    Array<Vec3i> faces_normals;
-};
+    Array<Vec3f> vertices;
+    Array<Vec3f> tex_coords;
+    Array<Vec3f> normals;
+    Array<Vec3i> faces_vertices;
+    Array<Vec3i> faces_textures;
+    Array<Vec3i> faces_normals;
+    // Set when the arrays point straight into a mapped mesh cache, instead of being
+    // allocated. They cannot be modified or grown in that case.
+    FileMapping *cache;
+};
+
+struct Vertex3
+{
+    Vec3f vertice;
+    Vec3f tex_coord;
+    // 1/w of the clip space position, 1 while there is no projection.
+    f32   inv_w;
+    Vertex3(Vec3f vertice, Vec3f tex_coord): vertice(vertice), tex_coord(tex_coord), inv_w(1.0f) {}
+};
+
+internal void
+obj_file_free(ObjFile *f)
+{
+    if (f->cache)
+    {
+        file_unmap(f->cache);
+        f->cache = NULL;
+        return;
+    }
+
+    array_free(&f->vertices);
+    array_free(&f->tex_coords);
+    array_free(&f->normals);
+    array_free(&f->faces_vertices);
+    array_free(&f->faces_textures);
+    array_free(&f->faces_normals);
+}
+
+/////////////////////////////////////////////////////////
+//
+// OBJ parsing
+//
+// The file is mapped in memory and tokenized in place. Every token is read by
+// walking a cursor forward, so there is no copying into line buffers and no libc
+// call per line.
+//
+
+internal inline bool
+obj_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+internal inline bool
+obj_is_digit(char c)
+{
+    return (u32)(c - '0') < 10;
+}
+
+internal inline const char *
+obj_skip_spaces(const char *at, const char *end)
+{
+    while (at < end && obj_is_space(*at))
+        at++;
+    return at;
+}
+
+// Returns the position right after the end of the current line.
+internal inline const char *
+obj_skip_line(const char *at, const char *end)
+{
+    while (at < end && *at != '\n')
+        at++;
+    return (at < end) ? at + 1 : end;
+}
+
+internal const char *
+obj_parse_int(const char *at, const char *end, i32 *out)
+{
+    bool negative = false;
+    if (at < end && (*at == '-' || *at == '+'))
+        negative = (*at++ == '-');
+
+    if (at == end || !obj_is_digit(*at))
+        LT_Fail("Expected an integer in the obj file\n");
+
+    i32 value = 0;
+    while (at < end && obj_is_digit(*at))
+        value = (value * 10) + (*at++ - '0');
+
+    *out = negative ? -value : value;
+    return at;
+}
+
+internal const char *
+obj_parse_float(const char *at, const char *end, f32 *out)
+{
+    // Powers of ten that are exactly representable as doubles.
+    local_persist const f64 powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+    bool negative = false;
+    if (at < end && (*at == '-' || *at == '+'))
+        negative = (*at++ == '-');
+
+    // Digits are accumulated in an integer and scaled once at the end. Digits past
+    // what fits in the mantissa only move the exponent.
+    u64 mantissa = 0;
+    i32 num_digits = 0;
+    i32 exponent = 0;
+    bool any_digit = false;
+
+    while (at < end && obj_is_digit(*at))
+    {
+        if (num_digits < 18)
+        {
+            mantissa = (mantissa * 10) + (*at - '0');
+            num_digits += (mantissa != 0);
+        }
+        else
+        {
+            exponent++;
+        }
+        any_digit = true;
+        at++;
+    }
+
+    if (at < end && *at == '.')
+    {
+        at++;
+        while (at < end && obj_is_digit(*at))
+        {
+            if (num_digits < 18)
+            {
+                mantissa = (mantissa * 10) + (*at - '0');
+                num_digits += (mantissa != 0);
+                exponent--;
+            }
+            any_digit = true;
+            at++;
+        }
+    }
+
+    if (!any_digit)
+        LT_Fail("Expected a number in the obj file\n");
+
+    if (at < end && (*at == 'e' || *at == 'E'))
+    {
+        i32 e;
+        at = obj_parse_int(at + 1, end, &e);
+        exponent += e;
+    }
+
+    f64 value = (f64)mantissa;
+    while (exponent > 22) { value *= 1e22; exponent -= 22; }
+    while (exponent < -22) { value /= 1e22; exponent += 22; }
+    if (exponent >= 0)
+        value *= powers_of_ten[exponent];
+    else
+        value /= powers_of_ten[-exponent];
+
+    *out = (f32)(negative ? -value : value);
+    return at;
+}
+
+// Parses up to three floats, the ones that are missing are left untouched.
+internal const char *
+obj_parse_vec3(const char *at, const char *end, Vec3f *v)
+{
+    for (i32 i = 0; i < 3; i++)
+    {
+        at = obj_skip_spaces(at, end);
+        if (at == end || *at == '\n')
+            break;
+        at = obj_parse_float(at, end, &v->val[i]);
+    }
+    return at;
+}
+
+// Parses a face corner in the form v/vt/vn, exactly as written in the file. The
+// indexes that are missing are returned as 0.
+internal const char *
+obj_parse_corner(const char *at, const char *end, i32 indexes[3])
+{
+    indexes[0] = indexes[1] = indexes[2] = 0;
+    at = obj_parse_int(at, end, &indexes[0]);
+    if (at < end && *at == '/')
+    {
+        at++;
+        if (at < end && *at != '/')
+            at = obj_parse_int(at, end, &indexes[1]);
+        if (at < end && *at == '/')
+            at = obj_parse_int(at + 1, end, &indexes[2]);
+    }
+    return at;
+}
+
+#define OBJ_BATCH_SIZE 1024
+
+// Output of the streaming parser. A batch holds the elements declared since the
+// previous batch and the triangles of the faces declared since then, polygons are
+// triangulated as a fan around their first corner. A batch is handed out as soon as
+// any of its streams fills up, so the parser needs the same memory no matter how
+// large the file is. Indexes start at 0 and missing ones are -1.
+struct ObjBatch
+{
+    Vec3f vertices[OBJ_BATCH_SIZE];
+    Vec3f tex_coords[OBJ_BATCH_SIZE];
+    Vec3f normals[OBJ_BATCH_SIZE];
+    Vec3i faces_vertices[OBJ_BATCH_SIZE];
+    Vec3i faces_textures[OBJ_BATCH_SIZE];
+    Vec3i faces_normals[OBJ_BATCH_SIZE];
+    i32   num_vertices;
+    i32   num_tex_coords;
+    i32   num_normals;
+    i32   num_faces;
+};
+
+typedef void (*ObjBatchProc)(const ObjBatch *batch, void *data);
+
+struct ObjParser
+{
+    const char   *at;
+    const char   *end;
+    // Elements declared so far, negative indexes count back from them.
+    isize         num_vertices;
+    isize         num_tex_coords;
+    isize         num_normals;
+    isize         num_faces;
+    // Set when only a part of the file is parsed, so negative indexes are relative
+    // to the elements of that part. The position of each of them is recorded for
+    // the vertex, texture and normal streams, counting every index of every triangle.
+    Array<isize> *relative_slots;
+    ObjBatch     *batch;
+    ObjBatchProc  proc;
+    void         *data;
+};
+
+// A face corner with its indexes already resolved.
+struct ObjCorner
+{
+    i32  indexes[3];
+    bool relative[3];
+};
+
+internal void
+obj_parser_flush(ObjParser *parser)
+{
+    ObjBatch *batch = parser->batch;
+    if (batch->num_vertices == 0 && batch->num_tex_coords == 0 &&
+        batch->num_normals == 0 && batch->num_faces == 0)
+        return;
+
+    parser->proc(batch, parser->data);
+    batch->num_vertices = 0;
+    batch->num_tex_coords = 0;
+    batch->num_normals = 0;
+    batch->num_faces = 0;
+}
+
+internal inline void
+obj_emit_element(ObjParser *parser, Vec3f *elements, i32 *len, isize *count, Vec3f element)
+{
+    if (*len == OBJ_BATCH_SIZE)
+        obj_parser_flush(parser);
+    elements[(*len)++] = element;
+    (*count)++;
+}
+
+internal inline ObjCorner
+obj_resolve_corner(const ObjParser *parser, const i32 indexes[3])
+{
+    const isize counts[3] = {parser->num_vertices, parser->num_tex_coords, parser->num_normals};
+
+    ObjCorner corner;
+    for (i32 s = 0; s < 3; s++)
+    {
+        corner.relative[s] = indexes[s] < 0;
+        corner.indexes[s] = corner.relative[s] ? (i32)(counts[s] + indexes[s]) : indexes[s] - 1;
+    }
+    return corner;
+}
+
+internal void
+obj_emit_triangle(ObjParser *parser, const ObjCorner *c1, const ObjCorner *c2, const ObjCorner *c3)
+{
+    ObjBatch *batch = parser->batch;
+    if (batch->num_faces == OBJ_BATCH_SIZE)
+        obj_parser_flush(parser);
+
+    const ObjCorner *corners[3] = {c1, c2, c3};
+    Vec3i *faces[3] = {
+        &batch->faces_vertices[batch->num_faces],
+        &batch->faces_textures[batch->num_faces],
+        &batch->faces_normals[batch->num_faces],
+    };
+
+    for (i32 s = 0; s < 3; s++)
+    {
+        for (i32 i = 0; i < 3; i++)
+        {
+            faces[s]->val[i] = corners[i]->indexes[s];
+            if (parser->relative_slots && corners[i]->relative[s])
+                array_push(&parser->relative_slots[s], (parser->num_faces * 3) + i);
+        }
+    }
+
+    batch->num_faces++;
+    parser->num_faces++;
+}
+
+internal inline bool
+obj_starts_with(const char *at, const char *end, const char *keyword)
+{
+    while (*keyword)
+    {
+        if (at == end || *at != *keyword)
+            return false;
+        at++;
+        keyword++;
+    }
+    return at == end || obj_is_space(*at) || *at == '\n';
+}
+
+internal void
+obj_parse(ObjParser *parser)
+{
+    const char *at = parser->at;
+    const char *end = parser->end;
+    ObjBatch *batch = parser->batch;
+
+    while (at < end)
+    {
+        at = obj_skip_spaces(at, end);
+        if (at == end)
+            break;
+
+        if (obj_starts_with(at, end, "v"))
+        {
+            Vec3f v(0, 0, 0);
+            at = obj_parse_vec3(at + 1, end, &v);
+            obj_emit_element(parser, batch->vertices, &batch->num_vertices, &parser->num_vertices, v);
+        }
+        else if (obj_starts_with(at, end, "vt"))
+        {
+            Vec3f v(0, 0, 0);
+            at = obj_parse_vec3(at + 2, end, &v);
+            obj_emit_element(parser, batch->tex_coords, &batch->num_tex_coords, &parser->num_tex_coords, v);
+        }
+        else if (obj_starts_with(at, end, "vn"))
+        {
+            Vec3f v(0, 0, 0);
+            at = obj_parse_vec3(at + 2, end, &v);
+            obj_emit_element(parser, batch->normals, &batch->num_normals, &parser->num_normals, v);
+        }
+        else if (obj_starts_with(at, end, "f"))
+        {
+            ObjCorner first, previous;
+            i32 num_corners = 0;
+
+            at += 1;
+            for (;;)
+            {
+                at = obj_skip_spaces(at, end);
+                if (at == end || *at == '\n' || *at == '#')
+                    break;
+
+                i32 indexes[3];
+                at = obj_parse_corner(at, end, indexes);
+                const ObjCorner corner = obj_resolve_corner(parser, indexes);
+
+                if (num_corners == 0)
+                    first = corner;
+                else if (num_corners >= 2)
+                    obj_emit_triangle(parser, &first, &previous, &corner);
+
+                previous = corner;
+                num_corners++;
+            }
+
+            if (num_corners < 3)
+                LT_Fail("Face with %d corners in the obj file\n", num_corners);
+        }
+        else if (at[0] == '#' || at[0] == '\n' ||
+                 obj_starts_with(at, end, "vp") || obj_starts_with(at, end, "l") ||
+                 obj_starts_with(at, end, "p") || obj_starts_with(at, end, "g") ||
+                 obj_starts_with(at, end, "o") || obj_starts_with(at, end, "s") ||
+                 obj_starts_with(at, end, "usemtl") || obj_starts_with(at, end, "mtllib"))
+        {
+            // Comments, groups, materials and statements that do not make triangles.
+        }
+        else
+        {
+            // TODO(leo): Better error handling
+            LT_Fail("Line started with %c\n", at[0]);
+        }
+
+        at = obj_skip_line(at, end);
+    }
+
+    parser->at = at;
+    obj_parser_flush(parser);
+}
+
+internal ObjParser
+obj_parser_make(const char *begin, const char *end, ObjBatchProc proc, void *data)
+{
+    ObjParser parser = {};
+    parser.at = begin;
+    parser.end = end;
+    parser.batch = (ObjBatch*)malloc(sizeof(ObjBatch));
+    parser.batch->num_vertices = 0;
+    parser.batch->num_tex_coords = 0;
+    parser.batch->num_normals = 0;
+    parser.batch->num_faces = 0;
+    parser.proc = proc;
+    parser.data = data;
+    return parser;
+}
+
+// Parses a whole obj file, calling proc for every batch. The indexes are counted
+// from the start of the file.
+internal void
+obj_file_stream(const char *filepath, ObjBatchProc proc, void *data)
+{
+    FileMapping *file = file_map(filepath);
+    if (file->error != FileError_None)
+    {
+        LT_Fail("Failed to open %s\n", filepath);
+    }
+
+    const char *begin = (const char*)file->data;
+    ObjParser parser = obj_parser_make(begin, begin + file->size, proc, data);
+    obj_parse(&parser);
+
+    free(parser.batch);
+    file_unmap(file);
+}
+
+template<typename T> internal inline void
+obj_append(Array<T> *arr, const T *elements, i32 len)
+{
+    for (i32 i = 0; i < len; i++)
+        array_push(arr, elements[i]);
+}
+
+// Batch procedure that collects the batches into an ObjFile.
+internal void
+obj_append_batch(const ObjBatch *batch, void *data)
+{
+    ObjFile *obj = (ObjFile*)data;
+    obj_append(&obj->vertices, batch->vertices, batch->num_vertices);
+    obj_append(&obj->tex_coords, batch->tex_coords, batch->num_tex_coords);
+    obj_append(&obj->normals, batch->normals, batch->num_normals);
+    obj_append(&obj->faces_vertices, batch->faces_vertices, batch->num_faces);
+    obj_append(&obj->faces_textures, batch->faces_textures, batch->num_faces);
+    obj_append(&obj->faces_normals, batch->faces_normals, batch->num_faces);
+}
+
+internal ObjFile
+obj_file_make()
+{
+    ObjFile obj;
+    obj.cache = NULL;
+    obj.vertices = array_make<Vec3f>();
+    obj.tex_coords = array_make<Vec3f>();
+    obj.normals = array_make<Vec3f>();
+    obj.faces_vertices = array_make<Vec3i>();
+    obj.faces_textures = array_make<Vec3i>();
+    obj.faces_normals = array_make<Vec3i>();
+    return obj;
+}
+
+// Files are split in chunks that are parsed on separate threads, so small files are
+// parsed by a single thread.
+#define OBJ_MIN_CHUNK_SIZE (1 << 18)
+
+// Part of the file parsed by a single thread. Negative indexes count back from the
+// last element declared, so they are resolved inside the chunk and their positions
+// are remembered, to be offset by the elements of the previous chunks when merging.
+struct ObjChunk
+{
+    const char  *begin;
+    const char  *end;
+    ObjFile      obj;
+    Array<isize> relative_slots[3];
+    // Where the elements of the chunk start in the merged file.
+    isize        first_vertex;
+    isize        first_tex_coord;
+    isize        first_normal;
+    isize        first_face;
+};
+
+struct ObjParseJob
+{
+    ObjChunk *chunks;
+    ObjFile  *obj;
+};
+
+internal void
+obj_parse_worker(void *data, i32 thread_index)
+{
+    ObjParseJob *job = (ObjParseJob*)data;
+    ObjChunk *chunk = &job->chunks[thread_index];
+
+    ObjParser parser = obj_parser_make(chunk->begin, chunk->end, obj_append_batch, &chunk->obj);
+    parser.relative_slots = chunk->relative_slots;
+    obj_parse(&parser);
+    free(parser.batch);
+}
+
+// Adds the elements of the previous chunks to the relative indexes of a face stream.
+internal void
+obj_fixup_relative(Vec3i *faces, const Array<isize> *slots, isize offset)
+{
+    for (isize i = 0; i < slots->len; i++)
+    {
+        const isize slot = slots->data[i];
+        faces[slot / 3].val[slot % 3] += (i32)offset;
+    }
+}
+
+// Copies a parsed chunk into its place in the merged file.
+internal void
+obj_merge_worker(void *data, i32 thread_index)
+{
+    ObjParseJob *job = (ObjParseJob*)data;
+    ObjChunk *chunk = &job->chunks[thread_index];
+    ObjFile *src = &chunk->obj;
+    ObjFile *dst = job->obj;
+
+    memcpy(dst->vertices.data + chunk->first_vertex, src->vertices.data,
+           sizeof(Vec3f) * src->vertices.len);
+    memcpy(dst->tex_coords.data + chunk->first_tex_coord, src->tex_coords.data,
+           sizeof(Vec3f) * src->tex_coords.len);
+    memcpy(dst->normals.data + chunk->first_normal, src->normals.data,
+           sizeof(Vec3f) * src->normals.len);
+
+    Vec3i *faces_vertices = dst->faces_vertices.data + chunk->first_face;
+    Vec3i *faces_textures = dst->faces_textures.data + chunk->first_face;
+    Vec3i *faces_normals = dst->faces_normals.data + chunk->first_face;
+    const isize num_faces = src->faces_vertices.len;
+
+    memcpy(faces_vertices, src->faces_vertices.data, sizeof(Vec3i) * num_faces);
+    memcpy(faces_textures, src->faces_textures.data, sizeof(Vec3i) * num_faces);
+    memcpy(faces_normals, src->faces_normals.data, sizeof(Vec3i) * num_faces);
+
+    obj_fixup_relative(faces_vertices, &chunk->relative_slots[0], chunk->first_vertex);
+    obj_fixup_relative(faces_textures, &chunk->relative_slots[1], chunk->first_tex_coord);
+    obj_fixup_relative(faces_normals, &chunk->relative_slots[2], chunk->first_normal);
+}
+
+internal ObjFile
+obj_file_parse(const char *filepath)
+{
+    const isize size = file_get_size(filepath);
+    const i32 num_chunks = (i32)lt_max((isize)1, lt_min((isize)thread_hardware_count(),
+                                                       size / OBJ_MIN_CHUNK_SIZE));
+
+    // Small files are streamed straight into the arrays.
+    if (num_chunks == 1)
+    {
+        ObjFile obj = obj_file_make();
+        obj_file_stream(filepath, obj_append_batch, &obj);
+        return obj;
+    }
+
+    FileMapping *file = file_map(filepath);
+    if (file->error != FileError_None)
+    {
+        LT_Fail("Failed to open %s\n", filepath);
+    }
+
+    const char *data = (const char*)file->data;
+    ObjChunk *chunks = (ObjChunk*)calloc(num_chunks, sizeof(ObjChunk));
+
+    // Split the file in chunks of about the same size, each ending after a newline.
+    const char *at = data;
+    for (i32 i = 0; i < num_chunks; i++)
+    {
+        const char *end = data + ((file->size * (i + 1)) / num_chunks);
+        end = (i == num_chunks - 1) ? data + file->size : obj_skip_line(lt_max(end, at), data + file->size);
+
+        ObjChunk *chunk = &chunks[i];
+        chunk->begin = at;
+        chunk->end = end;
+        chunk->obj = obj_file_make();
+        for (i32 s = 0; s < 3; s++)
+            chunk->relative_slots[s] = array_make<isize>();
+        at = end;
+    }
+
+    ObjParseJob job;
+    job.chunks = chunks;
+    thread_run_parallel(obj_parse_worker, &job, num_chunks);
+
+    // Prefix sum of the element counts, so every chunk knows where it goes.
+    isize num_vertices = 0, num_tex_coords = 0, num_normals = 0, num_faces = 0;
+    for (i32 i = 0; i < num_chunks; i++)
+    {
+        ObjChunk *chunk = &chunks[i];
+        chunk->first_vertex = num_vertices;
+        chunk->first_tex_coord = num_tex_coords;
+        chunk->first_normal = num_normals;
+        chunk->first_face = num_faces;
+        num_vertices += chunk->obj.vertices.len;
+        num_tex_coords += chunk->obj.tex_coords.len;
+        num_normals += chunk->obj.normals.len;
+        num_faces += chunk->obj.faces_vertices.len;
+    }
+
+    ObjFile obj;
+    obj.cache = NULL;
+    obj.vertices = array_make<Vec3f>(num_vertices);
+    obj.tex_coords = array_make<Vec3f>(num_tex_coords);
+    obj.normals = array_make<Vec3f>(num_normals);
+    obj.faces_vertices = array_make<Vec3i>(num_faces);
+    obj.faces_textures = array_make<Vec3i>(num_faces);
+    obj.faces_normals = array_make<Vec3i>(num_faces);
+    obj.vertices.len = num_vertices;
+    obj.tex_coords.len = num_tex_coords;
+    obj.normals.len = num_normals;
+    obj.faces_vertices.len = num_faces;
+    obj.faces_textures.len = num_faces;
+    obj.faces_normals.len = num_faces;
+
+    job.obj = &obj;
+    thread_run_parallel(obj_merge_worker, &job, num_chunks);
+
+    for (i32 i = 0; i < num_chunks; i++)
+    {
+        obj_file_free(&chunks[i].obj);
+        for (i32 s = 0; s < 3; s++)
+            array_free(&chunks[i].relative_slots[s]);
+    }
+    free(chunks);
+    file_unmap(file);
+
+    LT_Assert(obj.faces_vertices.len == obj.faces_textures.len);
+    return obj;
+}
+
+/////////////////////////////////////////////////////////
+//
+// Mesh cache
+//
+// The parsed arrays of an obj file are saved next to it in a binary file, which is
+// mapped on the next loads with the arrays pointing straight into the mapping. The
+// cache is used only while the size and modification time of the obj file match
+// the ones it was made from.
+//
+
+#define OBJ_CACHE_EXTENSION ".trmesh"
+#define OBJ_CACHE_MAGIC     0x48534d54 // "TMSH"
+#define OBJ_CACHE_VERSION   3
+// Every array starts at a multiple of this, counting from the start of the file.
+#define OBJ_CACHE_ALIGNMENT 64
+
+enum ObjCacheFlag
+{
+    ObjCacheFlag_Optimized = 1 << 0,
+};
+
+enum ObjCacheArray
+{
+    ObjCacheArray_Vertices,
+    ObjCacheArray_TexCoords,
+    ObjCacheArray_Normals,
+    ObjCacheArray_FacesVertices,
+    ObjCacheArray_FacesTextures,
+    ObjCacheArray_FacesNormals,
+
+    ObjCacheArray_Count,
+};
+
+struct ObjCacheHeader
+{
+    u32 magic;
+    u32 version;
+    // ObjCacheFlag values, the cache is only used if they match the ones requested.
+    u32 flags;
+    u32 padding;
+    i64 source_size;
+    i64 source_modification_time;
+    // Element counts and byte offsets of each array.
+    i64 lens[ObjCacheArray_Count];
+    i64 offsets[ObjCacheArray_Count];
+};
+
+internal inline i64
+obj_cache_align(i64 offset)
+{
+    return (offset + OBJ_CACHE_ALIGNMENT - 1) & ~(i64)(OBJ_CACHE_ALIGNMENT - 1);
+}
+
+internal String *
+obj_cache_path(const char *filepath)
+{
+    String *path = string_make(filepath);
+    string_concat(path, OBJ_CACHE_EXTENSION);
+    return path;
+}
+
+// Writes the cache for an obj file. Failing to write it is not an error, the file
+// will just be parsed again next time.
+internal void
+obj_cache_write(const ObjFile *obj, const char *filepath, u32 flags)
+{
+    const void *arrays[ObjCacheArray_Count] = {
+        obj->vertices.data, obj->tex_coords.data, obj->normals.data,
+        obj->faces_vertices.data, obj->faces_textures.data, obj->faces_normals.data,
+    };
+    const isize element_sizes[ObjCacheArray_Count] = {
+        sizeof(Vec3f), sizeof(Vec3f), sizeof(Vec3f), sizeof(Vec3i), sizeof(Vec3i), sizeof(Vec3i),
+    };
+
+    ObjCacheHeader header = {};
+    header.magic = OBJ_CACHE_MAGIC;
+    header.version = OBJ_CACHE_VERSION;
+    header.flags = flags;
+    header.source_size = file_get_size(filepath);
+    header.source_modification_time = file_get_modification_time(filepath);
+    header.lens[ObjCacheArray_Vertices] = obj->vertices.len;
+    header.lens[ObjCacheArray_TexCoords] = obj->tex_coords.len;
+    header.lens[ObjCacheArray_Normals] = obj->normals.len;
+    header.lens[ObjCacheArray_FacesVertices] = obj->faces_vertices.len;
+    header.lens[ObjCacheArray_FacesTextures] = obj->faces_textures.len;
+    header.lens[ObjCacheArray_FacesNormals] = obj->faces_normals.len;
+
+    i64 offset = obj_cache_align(sizeof(header));
+    for (i32 i = 0; i < ObjCacheArray_Count; i++)
+    {
+        header.offsets[i] = offset;
+        offset = obj_cache_align(offset + (header.lens[i] * element_sizes[i]));
+    }
+
+    String *path = obj_cache_path(filepath);
+    FILE *fp = fopen(path->data, "wb");
+    if (!fp)
+    {
+        string_free(path);
+        return;
+    }
+
+    const u8 padding[OBJ_CACHE_ALIGNMENT] = {};
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    i64 written = sizeof(header);
+    for (i32 i = 0; ok && i < ObjCacheArray_Count; i++)
+    {
+        const i64 size = header.lens[i] * element_sizes[i];
+        ok = fwrite(padding, 1, header.offsets[i] - written, fp) == (usize)(header.offsets[i] - written);
+        ok = ok && fwrite(arrays[i], 1, size, fp) == (usize)size;
+        written = header.offsets[i] + size;
+    }
+    fclose(fp);
+
+    // Never leave a truncated cache behind.
+    if (!ok)
+        remove(path->data);
+    string_free(path);
+}
+
+template<typename T> internal inline Array<T>
+obj_cache_array(const FileMapping *cache, const ObjCacheHeader *header, ObjCacheArray which)
+{
+    Array<T> arr;
+    arr.len = header->lens[which];
+    arr.capacity = header->lens[which];
+    arr.data = (T*)((u8*)cache->data + header->offsets[which]);
+    return arr;
+}
+
+// Maps the cache of an obj file, returns false if it is missing or out of date.
+internal bool
+obj_cache_load(ObjFile *obj, const char *filepath, u32 flags)
+{
+    String *path = obj_cache_path(filepath);
+    FileMapping *cache = file_map(path->data);
+    string_free(path);
+
+    if (cache->error != FileError_None || cache->size < (isize)sizeof(ObjCacheHeader))
+    {
+        file_unmap(cache);
+        return false;
+    }
+
+    const isize element_sizes[ObjCacheArray_Count] = {
+        sizeof(Vec3f), sizeof(Vec3f), sizeof(Vec3f), sizeof(Vec3i), sizeof(Vec3i), sizeof(Vec3i),
+    };
+
+    const ObjCacheHeader *header = (const ObjCacheHeader*)cache->data;
+    bool valid = header->magic == OBJ_CACHE_MAGIC &&
+        header->version == OBJ_CACHE_VERSION &&
+        header->flags == flags &&
+        header->source_size == file_get_size(filepath) &&
+        header->source_modification_time == file_get_modification_time(filepath);
+
+    for (i32 i = 0; valid && i < ObjCacheArray_Count; i++)
+    {
+        valid = header->lens[i] >= 0 &&
+            header->offsets[i] % OBJ_CACHE_ALIGNMENT == 0 &&
+            header->offsets[i] + (header->lens[i] * element_sizes[i]) <= cache->size;
+    }
+
+    if (!valid)
+    {
+        file_unmap(cache);
+        return false;
+    }
+
+    obj->vertices = obj_cache_array<Vec3f>(cache, header, ObjCacheArray_Vertices);
+    obj->tex_coords = obj_cache_array<Vec3f>(cache, header, ObjCacheArray_TexCoords);
+    obj->normals = obj_cache_array<Vec3f>(cache, header, ObjCacheArray_Normals);
+    obj->faces_vertices = obj_cache_array<Vec3i>(cache, header, ObjCacheArray_FacesVertices);
+    obj->faces_textures = obj_cache_array<Vec3i>(cache, header, ObjCacheArray_FacesTextures);
+    obj->faces_normals = obj_cache_array<Vec3i>(cache, header, ObjCacheArray_FacesNormals);
+    obj->cache = cache;
+    return true;
+}
+
+/////////////////////////////////////////////////////////
+//
+// Mesh
+//
+// Obj files index positions, texture coordinates and normals separately. Welding
+// gives every distinct (v, vt, vn) combination its own vertex, so a triangle is
+// just three indexes into a single set of vertices.
+//
+// Every vertex attribute is stored in its own stream, so the vertex stage can load
+// eight consecutive vertices into a register at once. The streams are 32 byte
+// aligned and padded with zeros to a multiple of MESH_STREAM_PADDING vertices.
+//
+
+#define MESH_STREAM_ALIGNMENT 32
+#define MESH_STREAM_PADDING   8
+
+struct Mesh
+{
+    isize       num_vertices;
+    f32        *x;
+    f32        *y;
+    f32        *z;
+    f32        *u;
+    f32        *v;
+    f32        *nx;
+    f32        *ny;
+    f32        *nz;
+    // Three per triangle.
+    Array<u32>  indices;
+};
+
+internal inline isize
+mesh_stream_len(isize num_vertices)
+{
+    return (num_vertices + MESH_STREAM_PADDING - 1) & ~(isize)(MESH_STREAM_PADDING - 1);
+}
+
+// Allocates a number of zeroed streams for the vertices in a single block, the block
+// is freed through the first stream.
+internal void
+mesh_streams_alloc(isize num_vertices, f32 **streams[], i32 num_streams)
+{
+    const isize len = mesh_stream_len(num_vertices);
+    void *block = NULL;
+    if (posix_memalign(&block, MESH_STREAM_ALIGNMENT, sizeof(f32) * len * num_streams) != 0)
+        LT_Fail("Failed allocating memory\n");
+    memset(block, 0, sizeof(f32) * len * num_streams);
+
+    for (i32 i = 0; i < num_streams; i++)
+        *streams[i] = (f32*)block + (len * i);
+}
+
+internal inline Vec3f
+mesh_position(const Mesh *mesh, u32 i)
+{
+    return Vec3f(mesh->x[i], mesh->y[i], mesh->z[i]);
+}
+
+internal inline u32
+mesh_hash_corner(i32 v, i32 t, i32 n)
+{
+    u32 h = (u32)v * 0x9e3779b1u;
+    h ^= (u32)t * 0x85ebca77u;
+    h ^= (u32)n * 0xc2b2ae3du;
+    return h ^ (h >> 15);
+}
+
+internal Mesh
+mesh_weld(const ObjFile *obj)
+{
+    const isize num_faces = obj->faces_vertices.len;
+
+    // Open addressing table from corners to vertex indexes, kept at most half full.
+    isize table_size = 16;
+    while (table_size < num_faces * 3 * 2)
+        table_size *= 2;
+    const u32 table_mask = (u32)(table_size - 1);
+
+    Vec3i *keys = (Vec3i*)malloc(sizeof(Vec3i) * table_size);
+    u32 *values = (u32*)malloc(sizeof(u32) * table_size);
+    for (isize i = 0; i < table_size; i++)
+        values[i] = 0xffffffffu;
+
+    // The corner of each vertex, in the order the vertices are found.
+    Array<Vec3i> corners = array_make<Vec3i>();
+
+    Mesh mesh;
+    mesh.indices = array_make<u32>(num_faces * 3);
+
+    for (isize f = 0; f < num_faces; f++)
+    {
+        for (i32 i = 0; i < 3; i++)
+        {
+            const Vec3i key(obj->faces_vertices.data[f].val[i],
+                            obj->faces_textures.data[f].val[i],
+                            obj->faces_normals.data[f].val[i]);
+
+            u32 slot = mesh_hash_corner(key.x, key.y, key.z) & table_mask;
+            while (values[slot] != 0xffffffffu &&
+                   (keys[slot].x != key.x || keys[slot].y != key.y || keys[slot].z != key.z))
+                slot = (slot + 1) & table_mask;
+
+            if (values[slot] == 0xffffffffu)
+            {
+                LT_Assert(key.x >= 0 && key.x < obj->vertices.len);
+                LT_Assert(key.y < obj->tex_coords.len);
+                LT_Assert(key.z < obj->normals.len);
+
+                keys[slot] = key;
+                values[slot] = (u32)corners.len;
+                array_push(&corners, key);
+            }
+
+            array_push(&mesh.indices, values[slot]);
+        }
+    }
+
+    mesh.num_vertices = corners.len;
+    f32 **streams[] = {&mesh.x, &mesh.y, &mesh.z, &mesh.u, &mesh.v, &mesh.nx, &mesh.ny, &mesh.nz};
+    mesh_streams_alloc(mesh.num_vertices, streams, lt_count(streams));
+
+    // Missing texture coordinates and normals are left as zeros.
+    for (isize i = 0; i < corners.len; i++)
+    {
+        const Vec3i corner = corners.data[i];
+        const Vec3f position = obj->vertices.data[corner.x];
+        mesh.x[i] = position.x;
+        mesh.y[i] = position.y;
+        mesh.z[i] = position.z;
+
+        if (corner.y >= 0)
+        {
+            mesh.u[i] = obj->tex_coords.data[corner.y].x;
+            mesh.v[i] = obj->tex_coords.data[corner.y].y;
+        }
+        if (corner.z >= 0)
+        {
+            const Vec3f normal = obj->normals.data[corner.z];
+            mesh.nx[i] = normal.x;
+            mesh.ny[i] = normal.y;
+            mesh.nz[i] = normal.z;
+        }
+    }
+
+    array_free(&corners);
+    free(keys);
+    free(values);
+    return mesh;
+}
+
+internal void
+mesh_free(Mesh *mesh)
+{
+    // All the streams are in the block of the first one.
+    free(mesh->x);
+    array_free(&mesh->indices);
+}
+
+/////////////////////////////////////////////////////////
+//
+// Mesh optimization
+//
+// Faces are first ordered for the post-transform vertex cache, following Tom
+// Forsyth's "Linear-Speed Vertex Cache Optimisation": the next triangle is always
+// the one whose vertices score best, favouring vertices that are in the cache and
+// vertices with few triangles left.
+//
+// The ordered faces are then split in clusters wherever the cache starts over, and
+// the clusters are sorted so the ones facing away from the center of the mesh are
+// drawn first. They are the most likely to occlude the others, so less pixels are
+// drawn and then overwritten (Sander, Nehab and Barczak, "Fast Triangle Reordering
+// for Vertex Locality and Reduced Overdraw").
+//
+
+#define VERTEX_CACHE_SIZE    32
+#define VERTEX_MAX_VALENCE   32
+
+struct VertexCacheScores
+{
+    f32 cache[VERTEX_CACHE_SIZE];
+    f32 valence[VERTEX_MAX_VALENCE];
+};
+
+internal void
+vertex_cache_scores_init(VertexCacheScores *scores)
+{
+    const f32 CACHE_DECAY_POWER = 1.5f;
+    const f32 LAST_TRIANGLE_SCORE = 0.75f;
+    const f32 VALENCE_BOOST_SCALE = 2.0f;
+    const f32 VALENCE_BOOST_POWER = 0.5f;
+
+    for (i32 i = 0; i < VERTEX_CACHE_SIZE; i++)
+    {
+        // The vertices of the last triangle get a fixed score, so triangles that
+        // would reuse all of them are not always picked, which would make strips.
+        if (i < 3)
+            scores->cache[i] = LAST_TRIANGLE_SCORE;
+        else
+            scores->cache[i] = powf(1.0f - ((f32)(i - 3) / (VERTEX_CACHE_SIZE - 3)), CACHE_DECAY_POWER);
+    }
+
+    scores->valence[0] = 0.0f;
+    for (i32 i = 1; i < VERTEX_MAX_VALENCE; i++)
+        scores->valence[i] = VALENCE_BOOST_SCALE * powf((f32)i, -VALENCE_BOOST_POWER);
+}
+
+internal inline f32
+vertex_cache_score(const VertexCacheScores *scores, i32 cache_position, i32 remaining)
+{
+    if (remaining == 0)
+        return -1.0f;
+
+    const f32 score = (cache_position >= 0) ? scores->cache[cache_position] : 0.0f;
+    return score + scores->valence[lt_min(remaining, VERTEX_MAX_VALENCE - 1)];
+}
+
+// Fills order with the triangles in the order they should be drawn.
+internal void
+mesh_optimize_vertex_cache(const u32 *indices, isize num_triangles, isize num_vertices, u32 *order)
+{
+    VertexCacheScores scores;
+    vertex_cache_scores_init(&scores);
+
+    // Triangles that use each vertex. The first remaining[v] of them are the ones
+    // that were not drawn yet.
+    i32 *remaining = (i32*)calloc(num_vertices, sizeof(i32));
+    isize *first_triangle = (isize*)malloc(sizeof(isize) * (num_vertices + 1));
+    u32 *adjacency = (u32*)malloc(sizeof(u32) * num_triangles * 3);
+
+    for (isize i = 0; i < num_triangles * 3; i++)
+        remaining[indices[i]]++;
+
+    first_triangle[0] = 0;
+    for (isize v = 0; v < num_vertices; v++)
+        first_triangle[v + 1] = first_triangle[v] + remaining[v];
+
+    for (isize v = 0; v < num_vertices; v++)
+        remaining[v] = 0;
+    for (isize t = 0; t < num_triangles; t++)
+        for (i32 i = 0; i < 3; i++)
+        {
+            const u32 v = indices[(t * 3) + i];
+            adjacency[first_triangle[v] + remaining[v]++] = (u32)t;
+        }
+
+    i32 *cache_position = (i32*)malloc(sizeof(i32) * num_vertices);
+    f32 *vertex_score = (f32*)malloc(sizeof(f32) * num_vertices);
+    for (isize v = 0; v < num_vertices; v++)
+    {
+        cache_position[v] = -1;
+        vertex_score[v] = vertex_cache_score(&scores, -1, remaining[v]);
+    }
+
+    f32 *triangle_score = (f32*)malloc(sizeof(f32) * num_triangles);
+    bool *drawn = (bool*)calloc(num_triangles, sizeof(bool));
+    for (isize t = 0; t < num_triangles; t++)
+    {
+        triangle_score[t] = vertex_score[indices[t * 3]] +
+            vertex_score[indices[(t * 3) + 1]] + vertex_score[indices[(t * 3) + 2]];
+    }
+
+    // The cache holds three more entries while a triangle is being added.
+    u32 cache[VERTEX_CACHE_SIZE + 3];
+    i32 cache_len = 0;
+
+    isize best = -1;
+    isize next_undrawn = 0;
+
+    for (isize n = 0; n < num_triangles; n++)
+    {
+        if (best < 0)
+        {
+            // Nothing in the cache has triangles left, continue from any triangle.
+            while (drawn[next_undrawn])
+                next_undrawn++;
+            best = next_undrawn;
+        }
+
+        order[n] = (u32)best;
+        drawn[best] = true;
+
+        u32 new_cache[VERTEX_CACHE_SIZE + 3];
+        i32 new_cache_len = 0;
+
+        for (i32 i = 0; i < 3; i++)
+        {
+            const u32 v = indices[(best * 3) + i];
+            new_cache[new_cache_len++] = v;
+
+            // Move the triangle past the ones remaining for the vertex.
+            u32 *triangles = adjacency + first_triangle[v];
+            for (i32 j = 0; j < remaining[v]; j++)
+            {
+                if (triangles[j] == (u32)best)
+                {
+                    triangles[j] = triangles[remaining[v] - 1];
+                    triangles[remaining[v] - 1] = (u32)best;
+                    break;
+                }
+            }
+            remaining[v]--;
+        }
+
+        for (i32 i = 0; i < cache_len; i++)
+        {
+            const u32 v = cache[i];
+            if (v != new_cache[0] && v != new_cache[1] && v != new_cache[2])
+                new_cache[new_cache_len++] = v;
+        }
+
+        // Vertices pushed out of the cache.
+        for (i32 i = VERTEX_CACHE_SIZE; i < new_cache_len; i++)
+        {
+            const u32 v = new_cache[i];
+            cache_position[v] = -1;
+            vertex_score[v] = vertex_cache_score(&scores, -1, remaining[v]);
+        }
+
+        cache_len = lt_min(new_cache_len, VERTEX_CACHE_SIZE);
+        for (i32 i = 0; i < cache_len; i++)
+        {
+            const u32 v = new_cache[i];
+            cache[i] = v;
+            cache_position[v] = i;
+            vertex_score[v] = vertex_cache_score(&scores, i, remaining[v]);
+        }
+
+        // Only the triangles of cached vertices changed score, the best of them is
+        // drawn next.
+        best = -1;
+        f32 best_score = 0.0f;
+        for (i32 i = 0; i < new_cache_len; i++)
+        {
+            const u32 v = new_cache[i];
+            const u32 *triangles = adjacency + first_triangle[v];
+            for (i32 j = 0; j < remaining[v]; j++)
+            {
+                const u32 t = triangles[j];
+                triangle_score[t] = vertex_score[indices[t * 3]] +
+                    vertex_score[indices[(t * 3) + 1]] + vertex_score[indices[(t * 3) + 2]];
+                if (triangle_score[t] > best_score)
+                {
+                    best = t;
+                    best_score = triangle_score[t];
+                }
+            }
+        }
+    }
+
+    free(remaining);
+    free(first_triangle);
+    free(adjacency);
+    free(cache_position);
+    free(vertex_score);
+    free(triangle_score);
+    free(drawn);
+}
+
+struct MeshCluster
+{
+    isize first;
+    isize len;
+    // How much the cluster faces away from the center of the mesh.
+    f32   sort_key;
+};
+
+internal i32
+mesh_cluster_compare(const void *a, const void *b)
+{
+    const MeshCluster *ca = (const MeshCluster*)a;
+    const MeshCluster *cb = (const MeshCluster*)b;
+    if (ca->sort_key != cb->sort_key)
+        return (ca->sort_key > cb->sort_key) ? -1 : 1;
+    // Keeps the sort stable.
+    return (ca->first < cb->first) ? -1 : 1;
+}
+
+// Sorts clusters of the triangles in order, keeping the triangles inside each
+// cluster in their vertex cache order.
+internal void
+mesh_optimize_overdraw(const Mesh *mesh, u32 *order)
+{
+    const u32 *indices = mesh->indices.data;
+    const isize num_triangles = mesh->indices.len / 3;
+    const isize num_vertices = mesh->num_vertices;
+
+    Vec3f mesh_center(0, 0, 0);
+    for (isize v = 0; v < num_vertices; v++)
+        mesh_center = mesh_center + mesh_position(mesh, (u32)v);
+    mesh_center = mesh_center * (1.0f / lt_max(num_vertices, (isize)1));
+
+    // A new cluster starts whenever a triangle misses the cache for all of its
+    // vertices. The cache is simulated as a FIFO.
+    isize *cached_at = (isize*)malloc(sizeof(isize) * num_vertices);
+    for (isize v = 0; v < num_vertices; v++)
+        cached_at[v] = -VERTEX_CACHE_SIZE - 1;
+
+    Array<MeshCluster> clusters = array_make<MeshCluster>();
+    isize time = 0;
+    for (isize n = 0; n < num_triangles; n++)
+    {
+        i32 misses = 0;
+        for (i32 i = 0; i < 3; i++)
+        {
+            const u32 v = indices[(order[n] * 3) + i];
+            if (time - cached_at[v] > VERTEX_CACHE_SIZE)
+            {
+                cached_at[v] = ++time;
+                misses++;
+            }
+        }
+
+        if (misses == 3 || clusters.len == 0)
+        {
+            MeshCluster cluster = {n, 0, 0.0f};
+            array_push(&clusters, cluster);
+        }
+        clusters.data[clusters.len - 1].len++;
+    }
+
+    for (isize c = 0; c < clusters.len; c++)
+    {
+        MeshCluster *cluster = &clusters.data[c];
+        Vec3f center(0, 0, 0);
+        Vec3f normal(0, 0, 0);
+        f32 area = 0.0f;
+
+        for (isize n = cluster->first; n < cluster->first + cluster->len; n++)
+        {
+            const Vec3f p1 = mesh_position(mesh, indices[order[n] * 3]);
+            const Vec3f p2 = mesh_position(mesh, indices[(order[n] * 3) + 1]);
+            const Vec3f p3 = mesh_position(mesh, indices[(order[n] * 3) + 2]);
+
+            // Twice the area, weighted by it so big triangles dominate.
+            const Vec3f cross = vec_cross(p2 - p1, p3 - p1);
+            const f32 triangle_area = vec_len(cross);
+            center = center + ((p1 + p2 + p3) * (triangle_area / 3.0f));
+            normal = normal + cross;
+            area += triangle_area;
+        }
+
+        if (area > 0.0f && vec_len(normal) > 0.0f)
+        {
+            center = center * (1.0f / area);
+            cluster->sort_key = vec_dot(center - mesh_center, vec_normalize(normal));
+        }
+    }
+
+    qsort(clusters.data, clusters.len, sizeof(MeshCluster), mesh_cluster_compare);
+
+    u32 *sorted = (u32*)malloc(sizeof(u32) * num_triangles);
+    isize n = 0;
+    for (isize c = 0; c < clusters.len; c++)
+        for (isize i = 0; i < clusters.data[c].len; i++)
+            sorted[n++] = order[clusters.data[c].first + i];
+    memcpy(order, sorted, sizeof(u32) * num_triangles);
+
+    free(sorted);
+    free(cached_at);
+    array_free(&clusters);
+}
+
+// Reorders the faces of an obj file, all the face streams are permuted together.
+internal void
+obj_file_optimize(ObjFile *obj)
+{
+    LT_Assert(obj->cache == NULL);
+
+    Mesh mesh = mesh_weld(obj);
+    const isize num_triangles = mesh.indices.len / 3;
+
+    u32 *order = (u32*)malloc(sizeof(u32) * num_triangles);
+    mesh_optimize_vertex_cache(mesh.indices.data, num_triangles, mesh.num_vertices, order);
+    mesh_optimize_overdraw(&mesh, order);
+
+    Array<Vec3i> *streams[3] = {&obj->faces_vertices, &obj->faces_textures, &obj->faces_normals};
+    Vec3i *reordered = (Vec3i*)malloc(sizeof(Vec3i) * num_triangles);
+    for (i32 s = 0; s < 3; s++)
+    {
+        for (isize n = 0; n < num_triangles; n++)
+            reordered[n] = streams[s]->data[order[n]];
+        memcpy(streams[s]->data, reordered, sizeof(Vec3i) * num_triangles);
+    }
+
+    free(reordered);
+    free(order);
+    mesh_free(&mesh);
+}
+
+// Loads an obj file from its cache, parsing it and writing the cache if needed.
+internal ObjFile
+obj_file_load(const char *filepath, bool optimize)
+{
+    const u32 flags = optimize ? ObjCacheFlag_Optimized : 0;
+
+    ObjFile obj;
+    if (obj_cache_load(&obj, filepath, flags))
+        return obj;
+
+    obj = obj_file_parse(filepath);
+    if (optimize)
+        obj_file_optimize(&obj);
+    obj_cache_write(&obj, filepath, flags);
+    return obj;
+}
+
+/////////////////////////////////////////////////////////
+//
+// Triangle setup
+//
+// Vertices are snapped to a 28.4 fixed point grid and the edge functions are evaluated
+// with integers at the pixel centers. Pixels that fall exactly over an edge follow the
+// top-left rule, so a pixel over an edge shared by two triangles is drawn by only one
+// of them.
+//
+
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_ONE  (1 << SUBPIXEL_BITS)
+#define SUBPIXEL_HALF (SUBPIXEL_ONE / 2)
+
+// Edge functions are stepped with 32 bit integers, which holds for triangles whose
+// bounding box is smaller than this in fixed point units on both axes. Bigger
+// triangles have to be clipped before reaching the rasterizer.
+#define MAX_TRIANGLE_EXTENT (1 << 16)
+
+// Biggest render target, in pixels on either axis. The target and the guard band on
+// both of its sides have to fit in MAX_TRIANGLE_EXTENT, so that clipped triangles are
+// never too big for the rasterizer.
+#define MAX_TARGET_SIZE ((MAX_TRIANGLE_EXTENT >> SUBPIXEL_BITS) - 4)
+
+static_assert(IMAGE_WIDTH <= MAX_TARGET_SIZE && IMAGE_HEIGHT <= MAX_TARGET_SIZE,
+              "The image is bigger than the fixed point range of the rasterizer");
+
+struct EdgeFunction
+{
+    // Evaluates to a*x + b*y + c in fixed point. It is zero over the edge and positive
+    // on the inner side of the triangle.
+    i32 a, b;
+    i64 c;
+    // Zero for top and left edges, -1 for the others, which moves their pixels out.
+    i32 bias;
+};
+
+struct TriangleSetup
+{
+    // The edge i is the one opposite to the vertex i, so its value divided by the
+    // double area of the triangle is the barycentric weight of that vertex.
+    EdgeFunction edges[3];
+    f32 inv_area;
+    // Pixels whose centers can be inside the triangle, inclusive.
+    i32 min_x, max_x;
+    i32 min_y, max_y;
+};
+
+internal inline i32
+subpixel_snap(f32 v)
+{
+    return (i32)floorf((v * SUBPIXEL_ONE) + 0.5f);
+}
+
+internal inline EdgeFunction
+edge_function_make(const Vec2i a, const Vec2i b)
+{
+    EdgeFunction e;
+    e.a = a.y - b.y;
+    e.b = b.x - a.x;
+    e.c = ((i64)a.x * b.y) - ((i64)a.y * b.x);
+    e.bias = 0;
+    return e;
+}
+
+// Value of the edge function at the center of the pixel (x, y), divided by the
+// subpixel resolution. The division rounds down, so the sign of the value is kept and
+// stepping one pixel adds exactly a or b to it.
+internal inline i32
+edge_function_eval(const EdgeFunction e, i32 x, i32 y)
+{
+    const i64 px = ((i64)x << SUBPIXEL_BITS) + SUBPIXEL_HALF;
+    const i64 py = ((i64)y << SUBPIXEL_BITS) + SUBPIXEL_HALF;
+    return (i32)(((e.a * px) + (e.b * py) + e.c + e.bias) >> SUBPIXEL_BITS);
+}
+
+// Computes everything that is constant over the triangle, so that the raster loop only
+// has to step the edge functions. Returns false if the triangle is degenerate or too
+// big for the fixed point range.
+internal bool
+triangle_setup(TriangleSetup *setup, const Vec3f v1, const Vec3f v2, const Vec3f v3)
+{
+    const Vec2i p1(subpixel_snap(v1.x), subpixel_snap(v1.y));
+    const Vec2i p2(subpixel_snap(v2.x), subpixel_snap(v2.y));
+    const Vec2i p3(subpixel_snap(v3.x), subpixel_snap(v3.y));
+
+    const i32 min_x = lt_min(p1.x, p2.x, p3.x);
+    const i32 max_x = lt_max(p1.x, p2.x, p3.x);
+    const i32 min_y = lt_min(p1.y, p2.y, p3.y);
+    const i32 max_y = lt_max(p1.y, p2.y, p3.y);
+
+    if (max_x - min_x >= MAX_TRIANGLE_EXTENT || max_y - min_y >= MAX_TRIANGLE_EXTENT)
+        return false;
+
+    setup->edges[0] = edge_function_make(p2, p3);
+    setup->edges[1] = edge_function_make(p3, p1);
+    setup->edges[2] = edge_function_make(p1, p2);
+
+    i64 double_area = ((i64)setup->edges[0].a * p1.x) + ((i64)setup->edges[0].b * p1.y) + setup->edges[0].c;
+
+    // Exact after snapping, zero means that the triangle is a line or a point.
+    if (double_area == 0)
+        return false;
+
+    if (double_area < 0)
+    {
+        // Clockwise triangle, flip the edges so that the inside is always positive.
+        for (i32 i = 0; i < 3; i++)
+        {
+            setup->edges[i].a = -setup->edges[i].a;
+            setup->edges[i].b = -setup->edges[i].b;
+            setup->edges[i].c = -setup->edges[i].c;
+        }
+        double_area = -double_area;
+    }
+
+    for (i32 i = 0; i < 3; i++)
+    {
+        // The inside grows to the right of a left edge, and it is below a horizontal
+        // top edge (y points up in the image).
+        EdgeFunction *e = &setup->edges[i];
+        const bool left_edge = e->a > 0;
+        const bool top_edge = e->a == 0 && e->b < 0;
+        e->bias = (left_edge || top_edge) ? 0 : -1;
+    }
+
+    // The edge values in the raster loop are already divided by the subpixel resolution.
+    setup->inv_area = (f32)SUBPIXEL_ONE / (f32)double_area;
+
+    // First and last pixel centers inside the fixed point bounding box.
+    setup->min_x = (min_x - SUBPIXEL_HALF + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS;
+    setup->max_x = (max_x - SUBPIXEL_HALF) >> SUBPIXEL_BITS;
+    setup->min_y = (min_y - SUBPIXEL_HALF + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS;
+    setup->max_y = (max_y - SUBPIXEL_HALF) >> SUBPIXEL_BITS;
+    return setup->min_x <= setup->max_x && setup->min_y <= setup->max_y;
+}
+
+struct Triangle
+{
+    TriangleSetup      setup;
+    // Vertex attributes, interpolated with the barycentric weights of the pixel. The
+    // texture coordinates are divided by w, since only that and 1/w are linear in
+    // screen space; the pixel divides them back by the interpolated 1/w.
+    Vec3f              depths;
+    Vec3f              inv_w;
+    Vec3f              u_over_w;
+    Vec3f              v_over_w;
+    // Screen space gradients of u/w, v/w and 1/w, with the texture coordinates scaled to
+    // texels. They give the texture footprint of a pixel, which selects the mipmap.
+    f32                u_over_w_dx, u_over_w_dy;
+    f32                v_over_w_dx, v_over_w_dy;
+    f32                inv_w_dx, inv_w_dy;
+    const TGAImageRGB *texture;
+    f32                intensity;
+    f32                min_depth;
+    f32                max_depth;
+};
+
+// Builds a screen space triangle ready to be binned and rasterized. Returns false
+// if there is nothing to draw.
+internal bool
+triangle_assemble(Triangle *tri, TGAImageRGB *tex, Vertex3 *v1, Vertex3 *v2, Vertex3 *v3, f32 intensity)
+{
+    if (!triangle_setup(&tri->setup, v1->vertice, v2->vertice, v3->vertice))
+        return false;
+
+    Vertex3 *vertices[3] = {v1, v2, v3};
+    for (i32 i = 0; i < 3; i++)
+    {
+        tri->depths.val[i] = vertices[i]->vertice.z;
+        tri->inv_w.val[i] = vertices[i]->inv_w;
+        tri->u_over_w.val[i] = vertices[i]->tex_coord.x * vertices[i]->inv_w;
+        tri->v_over_w.val[i] = vertices[i]->tex_coord.y * vertices[i]->inv_w;
+    }
+
+    // The barycentric weight of the vertex i changes by a*inv_area from one pixel to
+    // the next on x, and by b*inv_area on y.
+    const f32 inv_area = tri->setup.inv_area;
+    const f32 tex_width = lt_image_width(tex);
+    const f32 tex_height = lt_image_height(tex);
+    tri->u_over_w_dx = tri->v_over_w_dx = tri->inv_w_dx = 0;
+    tri->u_over_w_dy = tri->v_over_w_dy = tri->inv_w_dy = 0;
+    for (i32 i = 0; i < 3; i++)
+    {
+        const f32 db_dx = tri->setup.edges[i].a * inv_area;
+        const f32 db_dy = tri->setup.edges[i].b * inv_area;
+        tri->u_over_w_dx += tri->u_over_w.val[i] * tex_width * db_dx;
+        tri->u_over_w_dy += tri->u_over_w.val[i] * tex_width * db_dy;
+        tri->v_over_w_dx += tri->v_over_w.val[i] * tex_height * db_dx;
+        tri->v_over_w_dy += tri->v_over_w.val[i] * tex_height * db_dy;
+        tri->inv_w_dx += tri->inv_w.val[i] * db_dx;
+        tri->inv_w_dy += tri->inv_w.val[i] * db_dy;
+    }
+
+    tri->texture = tex;
+    tri->intensity = intensity;
+
+    tri->min_depth = lt_min(v1->vertice.z, v2->vertice.z, v3->vertice.z);
+    tri->max_depth = lt_max(v1->vertice.z, v2->vertice.z, v3->vertice.z);
+    return true;
+}
+
+/////////////////////////////////////////////////////////
+//
+// Hierarchical Z
+//
+// Coarse depth bounds kept alongside the z buffer, one pair for every 8x8 block and
+// one maximum for every tile. A triangle whose closest depth is not in front of the
+// farthest depth of a block can never pass the depth test there, so the block (or the
+// whole tile) is skipped. When the triangle is entirely in front of the closest depth
+// of a block, the depth test is skipped instead.
+//
+
+#define HIZ_BLOCK_SIZE 8
+
+static_assert(TILE_SIZE % HIZ_BLOCK_SIZE == 0, "Tiles should be made of whole blocks");
+
+struct HiZBuffer
+{
+    i32  blocks_x;
+    i32  blocks_y;
+    i32  tiles_x;
+    f32 *block_min;
+    f32 *block_max;
+    f32 *tile_max;
+};
+
+internal HiZBuffer
+hiz_make(i32 width, i32 height)
+{
+    HiZBuffer hiz;
+    hiz.blocks_x = (width + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+    hiz.blocks_y = (height + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+    hiz.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+
+    const i32 num_blocks = hiz.blocks_x * hiz.blocks_y;
+    const i32 num_tiles = hiz.tiles_x * ((height + TILE_SIZE - 1) / TILE_SIZE);
+
+    hiz.block_min = (f32*)malloc(sizeof(f32) * num_blocks);
+    hiz.block_max = (f32*)malloc(sizeof(f32) * num_blocks);
+    hiz.tile_max = (f32*)malloc(sizeof(f32) * num_tiles);
+
+    // Same as a cleared z buffer.
+    for (i32 i = 0; i < num_blocks; i++)
+    {
+        hiz.block_min[i] = FLT_MAX;
+        hiz.block_max[i] = FLT_MAX;
+    }
+    for (i32 i = 0; i < num_tiles; i++)
+        hiz.tile_max[i] = FLT_MAX;
+
+    return hiz;
+}
+
+internal void
+hiz_free(HiZBuffer *hiz)
+{
+    lt_free(hiz->block_min);
+    lt_free(hiz->block_max);
+    lt_free(hiz->tile_max);
+}
+
+// In the visibility buffer mode the raster pass does not shade anything. It stores
+// which triangle is visible in each pixel and where, and a second pass shades every
+// pixel exactly once, no matter how many times it was overdrawn.
+#define VISIBILITY_EMPTY 0xffffffffu
+
+struct VisibilityBuffer
+{
+    u32 *triangle_ids;
+    // Barycentric weights of the second and third vertices, the first one is implied.
+    f32 *barycentrics[2];
+};
+
+internal VisibilityBuffer
+visibility_buffer_make(isize num_pixels)
+{
+    VisibilityBuffer vis;
+    vis.triangle_ids = (u32*)malloc(sizeof(u32) * num_pixels);
+    vis.barycentrics[0] = (f32*)malloc(sizeof(f32) * num_pixels);
+    vis.barycentrics[1] = (f32*)malloc(sizeof(f32) * num_pixels);
+
+    for (isize i = 0; i < num_pixels; i++)
+        vis.triangle_ids[i] = VISIBILITY_EMPTY;
+
+    return vis;
+}
+
+internal void
+visibility_buffer_free(VisibilityBuffer *vis)
+{
+    lt_free(vis->triangle_ids);
+    lt_free(vis->barycentrics[0]);
+    lt_free(vis->barycentrics[1]);
+}
+
+struct RenderTarget
+{
+    TGAImageRGBA     *color;
+    f32              *depth;
+    HiZBuffer         hiz;
+    // NULL unless rendering in the visibility buffer mode.
+    VisibilityBuffer *visibility;
+    i32               width;
+    i32               height;
+};
+
+// Every surface of the render target is stored tile by tile, with the rows of a tile
+// next to each other, so the tile being rasterized is one contiguous piece of memory.
+// The surfaces are padded to whole tiles.
+internal inline isize
+target_storage(i32 width, i32 height)
+{
+    const isize tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const isize tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    return tiles_x * tiles_y * TILE_SIZE * TILE_SIZE;
+}
+
+internal inline isize
+target_pixel_index(const RenderTarget *target, i32 x, i32 y)
+{
+    const i32 tiles_x = (target->width + TILE_SIZE - 1) / TILE_SIZE;
+    const isize tile = (x / TILE_SIZE) + ((y / TILE_SIZE) * tiles_x);
+    return (tile * TILE_SIZE * TILE_SIZE) + (x % TILE_SIZE) + ((y % TILE_SIZE) * TILE_SIZE);
+}
+
+// Offset to be added to a surface pointer so it can be indexed with x, for the pixels
+// of row y that are inside the tile starting at tile_min_x.
+internal inline isize
+target_row_offset(const RenderTarget *target, i32 tile_min_x, i32 y)
+{
+    return target_pixel_index(target, tile_min_x, y) - tile_min_x;
+}
+
+// Recomputes the bounds of a block from the z buffer.
+internal void
+hiz_update_block(RenderTarget *target, i32 bx, i32 by)
+{
+    const i32 min_x = bx * HIZ_BLOCK_SIZE;
+    const i32 min_y = by * HIZ_BLOCK_SIZE;
+    const i32 max_x = lt_min(min_x + HIZ_BLOCK_SIZE, target->width);
+    const i32 max_y = lt_min(min_y + HIZ_BLOCK_SIZE, target->height);
+
+    f32 block_min = FLT_MAX;
+    f32 block_max = -FLT_MAX;
+    for (i32 y = min_y; y < max_y; y++)
+    {
+        // Blocks never cross tiles, so the row is contiguous.
+        const f32 *depth_row = target->depth + target_row_offset(target, min_x, y);
+        for (i32 x = min_x; x < max_x; x++)
+        {
+            block_min = lt_min(block_min, depth_row[x]);
+            block_max = lt_max(block_max, depth_row[x]);
+        }
+    }
+
+    const i32 index = bx + (by * target->hiz.blocks_x);
+    target->hiz.block_min[index] = block_min;
+    target->hiz.block_max[index] = block_max;
+}
+
+internal void
+hiz_update_tile(RenderTarget *target, i32 tx, i32 ty)
+{
+    HiZBuffer *hiz = &target->hiz;
+    const i32 blocks_per_tile = TILE_SIZE / HIZ_BLOCK_SIZE;
+    const i32 min_bx = tx * blocks_per_tile;
+    const i32 min_by = ty * blocks_per_tile;
+    const i32 max_bx = lt_min(min_bx + blocks_per_tile, hiz->blocks_x);
+    const i32 max_by = lt_min(min_by + blocks_per_tile, hiz->blocks_y);
+
+    f32 tile_max = -FLT_MAX;
+    for (i32 by = min_by; by < max_by; by++)
+        for (i32 bx = min_bx; bx < max_bx; bx++)
+            tile_max = lt_max(tile_max, hiz->block_max[bx + (by * hiz->blocks_x)]);
+
+    hiz->tile_max[tx + (ty * hiz->tiles_x)] = tile_max;
+}
+
+/////////////////////////////////////////////////////////
+//
+// Pixel kernels
+//
+// Coverage, depth test and shading for a span of pixels in a row. With AVX2 eight
+// pixels are processed at once, with SSE2 four at a time, and the scalar kernel is
+// used for whatever is left at the end of the span.
+//
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define RASTER_SIMD_WIDTH 8
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#  define RASTER_SIMD_WIDTH 4
+#else
+#  define RASTER_SIMD_WIDTH 1
+#endif
+
+// The row of every surface written by the raster pass. Only the color is written in
+// the forward mode, and only the visibility in the visibility buffer mode.
+struct RasterRow
+{
+    f32 *depth;
+    u32 *color;
+    u32 *triangle_ids;
+    f32 *barycentrics[2];
+};
+
+internal inline f32
+interpolate(const Vec3f values, f32 b1, f32 b2, f32 b3)
+{
+    return (values.x * b1) + (values.y * b2) + (values.z * b3);
+}
+
+internal inline u32
+color_pack(f32 r, f32 g, f32 b)
+{
+    i32 ri = lt_max(lt_min(r, 255.0f), 0.0f);
+    i32 gi = lt_max(lt_min(g, 255.0f), 0.0f);
+    i32 bi = lt_max(lt_min(b, 255.0f), 0.0f);
+    return (0xffu << 24) | (ri << 16) | (gi << 8) | bi;
+}
+
+internal inline u32
+shade_texel(u32 texel, f32 intensity)
+{
+    return color_pack(((texel >> 16) & 0xff) * intensity,
+                      ((texel >> 8) & 0xff) * intensity,
+                      (texel & 0xff) * intensity);
+}
 
-struct Vertex3
+// Trilinear texture lookup at the perspective correct coordinates (u, v), where w is
+// the interpolated clip space w of the pixel.
+internal inline u32
+texture_sample(const Triangle *tri, f32 u, f32 v, f32 w)
 {
-    Vec3f vertice;
-    Vec3f tex_coord;
-    Vertex3(Vec3f vertice, Vec3f tex_coord): vertice(vertice), tex_coord(tex_coord) {}
-};
+    // Derivative of a quotient: d(u) = (d(u/w) - u*d(1/w)) * w, already in texels.
+    const f32 tex_width = lt_image_width(tri->texture);
+    const f32 tex_height = lt_image_height(tri->texture);
+    const f32 du_dx = (tri->u_over_w_dx - (u * tex_width * tri->inv_w_dx)) * w;
+    const f32 du_dy = (tri->u_over_w_dy - (u * tex_width * tri->inv_w_dy)) * w;
+    const f32 dv_dx = (tri->v_over_w_dx - (v * tex_height * tri->inv_w_dx)) * w;
+    const f32 dv_dy = (tri->v_over_w_dy - (v * tex_height * tri->inv_w_dy)) * w;
 
-internal ObjFile
-obj_file_load(const char *filepath)
+    // The footprint is the longest of the two pixel axes mapped into the texture,
+    // lod = log2(sqrt(length^2)).
+    const f32 footprint_sq = lt_max((du_dx * du_dx) + (dv_dx * dv_dx), (du_dy * du_dy) + (dv_dy * dv_dy));
+    const f32 lod = 0.5f * log2f(lt_max(footprint_sq, 1e-8f));
+
+    return lt_image_sample_trilinear(tri->texture, u, v, lod);
+}
+
+internal inline u32
+shade_pixel(const Triangle *tri, f32 b1, f32 b2, f32 b3)
 {
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp)
+    const f32 w = 1.0f / interpolate(tri->inv_w, b1, b2, b3);
+    const f32 u = interpolate(tri->u_over_w, b1, b2, b3) * w;
+    const f32 v = interpolate(tri->v_over_w, b1, b2, b3) * w;
+    return shade_texel(texture_sample(tri, u, v, w), tri->intensity);
+}
+
+// Returns true if any pixel was written.
+internal bool
+raster_span_scalar(const Triangle *tri, u32 triangle_id, const RasterRow *row,
+                   i32 min_x, i32 max_x, i32 w1, i32 w2, i32 w3, bool depth_test)
+{
+    const EdgeFunction *edges = tri->setup.edges;
+    const f32 inv_area = tri->setup.inv_area;
+    bool written = false;
+
+    for (i32 x = min_x; x <= max_x; x++)
     {
-        LT_Fail("Failed to open %s\n", filepath);
+        // Inside when none of the edge values has the sign bit set.
+        if ((w1 | w2 | w3) >= 0)
+        {
+            const f32 b1 = w1 * inv_area;
+            const f32 b2 = w2 * inv_area;
+            const f32 b3 = w3 * inv_area;
+            f32 z = interpolate(tri->depths, b1, b2, b3);
+
+            if (!depth_test || z < row->depth[x])
+            {
+                written = true;
+                row->depth[x] = z;
+                if (row->triangle_ids)
+                {
+                    row->triangle_ids[x] = triangle_id;
+                    row->barycentrics[0][x] = b2;
+                    row->barycentrics[1][x] = b3;
+                }
+                else
+                {
+                    row->color[x] = shade_pixel(tri, b1, b2, b3);
+                }
+            }
+        }
+
+        w1 += edges[0].a;
+        w2 += edges[1].a;
+        w3 += edges[2].a;
     }
 
-    const i32 BUF_SIZE = 1000;
-    char buf[BUF_SIZE] = {0};
+    return written;
+}
+
+#if RASTER_SIMD_WIDTH == 8
+
+internal inline __m256
+interpolate_x8(const Vec3f values, __m256 b1, __m256 b2, __m256 b3)
+{
+    __m256 r = _mm256_mul_ps(_mm256_set1_ps(values.x), b1);
+    r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_set1_ps(values.y), b2));
+    return _mm256_add_ps(r, _mm256_mul_ps(_mm256_set1_ps(values.z), b3));
+}
+
+// Perspective correct texture lookups for the lanes in the mask. The coordinates are
+// computed for all lanes at once, the texels are fetched one by one.
+internal inline __m256i
+sample_x8(const Triangle *tri, __m256 b1, __m256 b2, __m256 b3, i32 lane_mask)
+{
+    const __m256 w = _mm256_div_ps(_mm256_set1_ps(1.0f), interpolate_x8(tri->inv_w, b1, b2, b3));
+    alignas(32) f32 u[8];
+    alignas(32) f32 v[8];
+    alignas(32) f32 ws[8];
+    alignas(32) u32 texels[8] = {};
+    _mm256_store_ps(u, _mm256_mul_ps(interpolate_x8(tri->u_over_w, b1, b2, b3), w));
+    _mm256_store_ps(v, _mm256_mul_ps(interpolate_x8(tri->v_over_w, b1, b2, b3), w));
+    _mm256_store_ps(ws, w);
+
+    for (i32 i = 0; i < 8; i++)
+        if (lane_mask & (1 << i))
+            texels[i] = texture_sample(tri, u[i], v[i], ws[i]);
+
+    return _mm256_load_si256((__m256i*)texels);
+}
+
+internal inline __m256i
+shade_texels_x8(__m256i texels, f32 intensity)
+{
+    const __m256i channel_mask = _mm256_set1_epi32(0xff);
+    const __m256 k = _mm256_set1_ps(intensity);
+    // The intensity is never above 1, so the channels cannot overflow.
+    __m256i r = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texels, 16), channel_mask)), k));
+    __m256i g = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(texels, 8), channel_mask)), k));
+    __m256i b = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(texels, channel_mask)), k));
+    return _mm256_or_si256(_mm256_set1_epi32(0xff000000),
+                           _mm256_or_si256(_mm256_slli_epi32(r, 16),
+                                           _mm256_or_si256(_mm256_slli_epi32(g, 8), b)));
+}
+
+// Returns the first pixel that was not processed.
+internal i32
+raster_span_simd(const Triangle *tri, u32 triangle_id, const RasterRow *row,
+                 i32 min_x, i32 max_x, i32 w1_start, i32 w2_start, i32 w3_start,
+                 bool depth_test, bool *written)
+{
+    const EdgeFunction *edges = tri->setup.edges;
+    const __m256 inv_area = _mm256_set1_ps(tri->setup.inv_area);
+    const __m256i lane_indexes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i minus_one = _mm256_set1_epi32(-1);
 
-    Array<Vec3f> vertices = array_make<Vec3f>();
-    Array<Vec3f> tex_coords = array_make<Vec3f>();
-    Array<Vec3i> faces_vertices = array_make<Vec3i>();
-    Array<Vec3i> faces_textures = array_make<Vec3i>();
-    Array<Vec3i> faces_normals = array_make<Vec3i>();
+    __m256i w1i = _mm256_add_epi32(_mm256_set1_epi32(w1_start), _mm256_mullo_epi32(lane_indexes, _mm256_set1_epi32(edges[0].a)));
+    __m256i w2i = _mm256_add_epi32(_mm256_set1_epi32(w2_start), _mm256_mullo_epi32(lane_indexes, _mm256_set1_epi32(edges[1].a)));
+    __m256i w3i = _mm256_add_epi32(_mm256_set1_epi32(w3_start), _mm256_mullo_epi32(lane_indexes, _mm256_set1_epi32(edges[2].a)));
+    const __m256i w1_step = _mm256_set1_epi32(edges[0].a * 8);
+    const __m256i w2_step = _mm256_set1_epi32(edges[1].a * 8);
+    const __m256i w3_step = _mm256_set1_epi32(edges[2].a * 8);
 
-    while(fgets(buf, BUF_SIZE, fp) != NULL)
+    for (i32 x = min_x; x <= max_x; x += 8)
     {
-        // Check if buffer was completely filled.
-        if (buf[BUF_SIZE-1] != '\n' && buf[BUF_SIZE-1] != 0)
-        {
-            LT_Fail("Buffer was overrun\n");
-        }
+        // Lanes past the end of the span are masked out, the masked loads and stores
+        // never touch their memory. A pixel is inside when none of its edge values has
+        // the sign bit set.
+        __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(max_x - x + 1), lane_indexes);
+        __m256i inside = _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(w1i, w2i), w3i), minus_one);
+        __m256 mask = _mm256_castsi256_ps(_mm256_and_si256(valid, inside));
 
-        // Ignore certain lines.
-        if (buf[0] == '#' || buf[0] == '\n' || buf[0] == 'g' || buf[0] == 's')
+        if (_mm256_movemask_ps(mask))
         {
-            continue;
+            const __m256 b1 = _mm256_mul_ps(_mm256_cvtepi32_ps(w1i), inv_area);
+            const __m256 b2 = _mm256_mul_ps(_mm256_cvtepi32_ps(w2i), inv_area);
+            const __m256 b3 = _mm256_mul_ps(_mm256_cvtepi32_ps(w3i), inv_area);
+            __m256 z = interpolate_x8(tri->depths, b1, b2, b3);
+            if (depth_test)
+            {
+                __m256 z_old = _mm256_maskload_ps(row->depth + x, _mm256_castps_si256(mask));
+                mask = _mm256_and_ps(mask, _mm256_cmp_ps(z, z_old, _CMP_LT_OQ));
+            }
+
+            if (_mm256_movemask_ps(mask))
+            {
+                const __m256i imask = _mm256_castps_si256(mask);
+                *written = true;
+                _mm256_maskstore_ps(row->depth + x, imask, z);
+
+                if (row->triangle_ids)
+                {
+                    _mm256_maskstore_epi32((int*)(row->triangle_ids + x), imask, _mm256_set1_epi32(triangle_id));
+                    _mm256_maskstore_ps(row->barycentrics[0] + x, imask, b2);
+                    _mm256_maskstore_ps(row->barycentrics[1] + x, imask, b3);
+                }
+                else
+                {
+                    __m256i texels = sample_x8(tri, b1, b2, b3, _mm256_movemask_ps(mask));
+                    __m256i color = shade_texels_x8(texels, tri->intensity);
+                    _mm256_maskstore_epi32((int*)(row->color + x), imask, color);
+                }
+            }
         }
 
-        if (strncmp(buf, "vt", 2) == 0)
+        w1i = _mm256_add_epi32(w1i, w1_step);
+        w2i = _mm256_add_epi32(w2i, w2_step);
+        w3i = _mm256_add_epi32(w3i, w3_step);
+    }
+
+    return max_x + 1;
+}
+
+#elif RASTER_SIMD_WIDTH == 4
+
+internal inline __m128
+interpolate_x4(const Vec3f values, __m128 b1, __m128 b2, __m128 b3)
+{
+    __m128 r = _mm_mul_ps(_mm_set1_ps(values.x), b1);
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(values.y), b2));
+    return _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(values.z), b3));
+}
+
+// Perspective correct texture lookups for the lanes in the mask. The coordinates are
+// computed for all lanes at once, the texels are fetched one by one.
+internal inline __m128i
+sample_x4(const Triangle *tri, __m128 b1, __m128 b2, __m128 b3, i32 lane_mask)
+{
+    const __m128 w = _mm_div_ps(_mm_set1_ps(1.0f), interpolate_x4(tri->inv_w, b1, b2, b3));
+    alignas(16) f32 u[4];
+    alignas(16) f32 v[4];
+    alignas(16) f32 ws[4];
+    alignas(16) u32 texels[4] = {};
+    _mm_store_ps(u, _mm_mul_ps(interpolate_x4(tri->u_over_w, b1, b2, b3), w));
+    _mm_store_ps(v, _mm_mul_ps(interpolate_x4(tri->v_over_w, b1, b2, b3), w));
+    _mm_store_ps(ws, w);
+
+    for (i32 i = 0; i < 4; i++)
+        if (lane_mask & (1 << i))
+            texels[i] = texture_sample(tri, u[i], v[i], ws[i]);
+
+    return _mm_load_si128((__m128i*)texels);
+}
+
+internal inline __m128i
+shade_texels_x4(__m128i texels, f32 intensity)
+{
+    const __m128i channel_mask = _mm_set1_epi32(0xff);
+    const __m128 k = _mm_set1_ps(intensity);
+    // The intensity is never above 1, so the channels cannot overflow.
+    __m128i r = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(texels, 16), channel_mask)), k));
+    __m128i g = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(texels, 8), channel_mask)), k));
+    __m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(texels, channel_mask)), k));
+    return _mm_or_si128(_mm_set1_epi32(0xff000000),
+                        _mm_or_si128(_mm_slli_epi32(r, 16),
+                                     _mm_or_si128(_mm_slli_epi32(g, 8), b)));
+}
+
+// Writes the lanes of v selected by the mask and keeps the others.
+internal inline void
+masked_store_x4(void *dst, __m128i mask, __m128i v)
+{
+    __m128i old = _mm_loadu_si128((__m128i*)dst);
+    _mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_and_si128(mask, v), _mm_andnot_si128(mask, old)));
+}
+
+// Returns the first pixel that was not processed. SSE2 has no masked loads, so only
+// whole groups of four pixels are handled here.
+internal i32
+raster_span_simd(const Triangle *tri, u32 triangle_id, const RasterRow *row,
+                 i32 min_x, i32 max_x, i32 w1_start, i32 w2_start, i32 w3_start,
+                 bool depth_test, bool *written)
+{
+    const EdgeFunction *edges = tri->setup.edges;
+    const __m128 inv_area = _mm_set1_ps(tri->setup.inv_area);
+    const __m128i minus_one = _mm_set1_epi32(-1);
+
+    // SSE2 has no 32 bit multiply, the lane offsets are added one step at a time.
+    __m128i w1i = _mm_setr_epi32(w1_start, w1_start + edges[0].a, w1_start + (edges[0].a * 2), w1_start + (edges[0].a * 3));
+    __m128i w2i = _mm_setr_epi32(w2_start, w2_start + edges[1].a, w2_start + (edges[1].a * 2), w2_start + (edges[1].a * 3));
+    __m128i w3i = _mm_setr_epi32(w3_start, w3_start + edges[2].a, w3_start + (edges[2].a * 2), w3_start + (edges[2].a * 3));
+    const __m128i w1_step = _mm_set1_epi32(edges[0].a * 4);
+    const __m128i w2_step = _mm_set1_epi32(edges[1].a * 4);
+    const __m128i w3_step = _mm_set1_epi32(edges[2].a * 4);
+
+    i32 x = min_x;
+    for (; x + 3 <= max_x; x += 4)
+    {
+        // A pixel is inside when none of its edge values has the sign bit set.
+        __m128i inside = _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(w1i, w2i), w3i), minus_one);
+        __m128 mask = _mm_castsi128_ps(inside);
+
+        if (_mm_movemask_ps(mask))
         {
-            Vec3f v;
-            sscanf(buf, "vt %f %f %f", &v.x, &v.y, &v.z);
-            array_push(&tex_coords, v);
-            continue;
+            const __m128 b1 = _mm_mul_ps(_mm_cvtepi32_ps(w1i), inv_area);
+            const __m128 b2 = _mm_mul_ps(_mm_cvtepi32_ps(w2i), inv_area);
+            const __m128 b3 = _mm_mul_ps(_mm_cvtepi32_ps(w3i), inv_area);
+            __m128 z = interpolate_x4(tri->depths, b1, b2, b3);
+            if (depth_test)
+                mask = _mm_and_ps(mask, _mm_cmplt_ps(z, _mm_loadu_ps(row->depth + x)));
+
+            if (_mm_movemask_ps(mask))
+            {
+                const __m128i imask = _mm_castps_si128(mask);
+                *written = true;
+                masked_store_x4(row->depth + x, imask, _mm_castps_si128(z));
+
+                if (row->triangle_ids)
+                {
+                    masked_store_x4(row->triangle_ids + x, imask, _mm_set1_epi32(triangle_id));
+                    masked_store_x4(row->barycentrics[0] + x, imask, _mm_castps_si128(b2));
+                    masked_store_x4(row->barycentrics[1] + x, imask, _mm_castps_si128(b3));
+                }
+                else
+                {
+                    __m128i texels = sample_x4(tri, b1, b2, b3, _mm_movemask_ps(mask));
+                    __m128i color = shade_texels_x4(texels, tri->intensity);
+                    masked_store_x4(row->color + x, imask, color);
+                }
+            }
         }
 
-        if (strncmp(buf, "vn", 2) == 0)
+        w1i = _mm_add_epi32(w1i, w1_step);
+        w2i = _mm_add_epi32(w2i, w2_step);
+        w3i = _mm_add_epi32(w3i, w3_step);
+    }
+
+    return x;
+}
+
+#endif // RASTER_SIMD_WIDTH
+
+// Returns true if any pixel was written, the spans are then merged into the depth
+// bounds of their blocks.
+internal bool
+raster_span(const Triangle *tri, u32 triangle_id, const RasterRow *row,
+            i32 min_x, i32 max_x, i32 w1, i32 w2, i32 w3, bool depth_test)
+{
+    bool written = false;
+    i32 x = min_x;
+#if RASTER_SIMD_WIDTH > 1
+    x = raster_span_simd(tri, triangle_id, row, min_x, max_x, w1, w2, w3, depth_test, &written);
+#endif
+    if (x <= max_x)
+    {
+        const EdgeFunction *edges = tri->setup.edges;
+        const i32 dx = x - min_x;
+        written |= raster_span_scalar(tri, triangle_id, row, x, max_x,
+                                      w1 + (edges[0].a * dx), w2 + (edges[1].a * dx), w3 + (edges[2].a * dx),
+                                      depth_test);
+    }
+    return written;
+}
+
+enum BlockState
+{
+    BlockState_Rejected,
+    BlockState_DepthTest,
+    BlockState_Accepted,
+};
+
+// Rasterizes the part of the triangle that falls inside a tile. The bounds are
+// inclusive. Returns true if any pixel was written.
+internal bool
+draw_filled_triangle(RenderTarget *target, const Triangle *tri, u32 triangle_id,
+                     i32 clip_min_x, i32 clip_min_y, i32 clip_max_x, i32 clip_max_y)
+{
+    const TriangleSetup *setup = &tri->setup;
+    const HiZBuffer *hiz = &target->hiz;
+
+    LT_Assert(clip_max_x - clip_min_x < TILE_SIZE);
+    LT_Assert(clip_max_y - clip_min_y < TILE_SIZE);
+
+    i32 min_x = lt_max(setup->min_x, clip_min_x);
+    i32 max_x = lt_min(setup->max_x, clip_max_x);
+    i32 min_y = lt_max(setup->min_y, clip_min_y);
+    i32 max_y = lt_min(setup->max_y, clip_max_y);
+
+    const EdgeFunction e1 = setup->edges[0];
+    const EdgeFunction e2 = setup->edges[1];
+    const EdgeFunction e3 = setup->edges[2];
+
+    const i32 min_bx = min_x / HIZ_BLOCK_SIZE;
+    const i32 max_bx = max_x / HIZ_BLOCK_SIZE;
+    const i32 min_by = min_y / HIZ_BLOCK_SIZE;
+    const i32 max_by = max_y / HIZ_BLOCK_SIZE;
+    const i32 tile_min_x = (clip_min_x / TILE_SIZE) * TILE_SIZE;
+
+    bool tile_written = false;
+
+    for (i32 by = min_by; by <= max_by; by++)
+    {
+        BlockState states[TILE_SIZE / HIZ_BLOCK_SIZE];
+        bool       written[TILE_SIZE / HIZ_BLOCK_SIZE] = {};
+        bool       any_visible = false;
+
+        for (i32 bx = min_bx; bx <= max_bx; bx++)
         {
-            continue;
+            const i32 index = bx + (by * hiz->blocks_x);
+            BlockState state = BlockState_DepthTest;
+            if (tri->min_depth >= hiz->block_max[index])
+                state = BlockState_Rejected;
+            else if (tri->max_depth < hiz->block_min[index])
+                state = BlockState_Accepted;
+
+            states[bx - min_bx] = state;
+            any_visible |= (state != BlockState_Rejected);
         }
 
-        if (buf[0] == 'v')
-        {
-            Vec3f v;
-            sscanf(buf, "v %f %f %f", &v.x, &v.y, &v.z);
-            array_push(&vertices, v);
+        if (!any_visible)
             continue;
-        }
 
-        if (buf[0] == 'f')
+        const i32 row_min_y = lt_max(by * HIZ_BLOCK_SIZE, min_y);
+        const i32 row_max_y = lt_min((by * HIZ_BLOCK_SIZE) + HIZ_BLOCK_SIZE - 1, max_y);
+
+        for (i32 y = row_min_y; y <= row_max_y; y++)
         {
-            Vec3i face_v, face_t, face_n;
+            const isize row_offset = target_row_offset(target, tile_min_x, y);
+
+            RasterRow row = {};
+            row.depth = target->depth + row_offset;
+            if (target->visibility)
+            {
+                row.triangle_ids = target->visibility->triangle_ids + row_offset;
+                row.barycentrics[0] = target->visibility->barycentrics[0] + row_offset;
+                row.barycentrics[1] = target->visibility->barycentrics[1] + row_offset;
+            }
+            else
+            {
+                row.color = target->color->data + row_offset;
+            }
+
+            // Walk the row in runs of neighbouring blocks that share the same state.
+            i32 bx = min_bx;
+            while (bx <= max_bx)
+            {
+                const BlockState state = states[bx - min_bx];
+                i32 run_end = bx;
+                while (run_end + 1 <= max_bx && states[run_end + 1 - min_bx] == state)
+                    run_end++;
+
+                if (state != BlockState_Rejected)
+                {
+                    const i32 span_min_x = lt_max(bx * HIZ_BLOCK_SIZE, min_x);
+                    const i32 span_max_x = lt_min((run_end * HIZ_BLOCK_SIZE) + HIZ_BLOCK_SIZE - 1, max_x);
 
-            sscanf(buf, "f %d/%d/%d %d/%d/%d %d/%d/%d",
-                   &face_v.x, &face_t.x, &face_n.x, &face_v.y, &face_t.y, &face_n.y,
-                   &face_v.z, &face_t.z, &face_n.z);
+                    // Edge values at the start of the span, they are stepped with
+                    // additions from here on.
+                    const i32 w1 = edge_function_eval(e1, span_min_x, y);
+                    const i32 w2 = edge_function_eval(e2, span_min_x, y);
+                    const i32 w3 = edge_function_eval(e3, span_min_x, y);
 
-            // The indexes start at index 1 in the file.
-            face_v.x--; face_v.y--; face_v.z--;
-            face_t.x--; face_t.y--; face_t.z--;
-            face_n.x--; face_n.y--; face_n.z--;
+                    if (raster_span(tri, triangle_id, &row, span_min_x, span_max_x,
+                                    w1, w2, w3, state == BlockState_DepthTest))
+                    {
+                        for (i32 i = bx; i <= run_end; i++)
+                            written[i - min_bx] = true;
+                    }
+                }
 
-            array_push(&faces_vertices, face_v);
-            array_push(&faces_textures, face_t);
-            array_push(&faces_normals, face_n);
+                bx = run_end + 1;
+            }
         }
-        else
+
+        for (i32 bx = min_bx; bx <= max_bx; bx++)
         {
-            fclose(fp);
-            // TODO(leo): Better error handling
-            LT_Fail("Line started with %c\n", buf[0]);
+            if (written[bx - min_bx])
+            {
+                hiz_update_block(target, bx, by);
+                tile_written = true;
+            }
         }
-
-        memset(buf, 0, BUF_SIZE);
     }
 
-    fclose(fp);
+    return tile_written;
+}
 
-    ObjFile obj;
-    obj.vertices = vertices;
-    obj.tex_coords = tex_coords;
-    obj.faces_vertices = faces_vertices;
-    obj.faces_textures = faces_textures;
-    obj.faces_normals = faces_normals;
+/////////////////////////////////////////////////////////
+//
+// Tile binning
+//
+// The render target is split in square tiles. Every triangle is first appended to the
+// list of each tile its bounding box touches, then every tile is rasterized by a single
+// thread. Since no two threads ever touch the same pixel, no locking is needed.
+//
 
-    LT_Assert(faces_vertices.len == faces_textures.len);
-    return obj;
+struct TileBins
+{
+    i32          tiles_x;
+    i32          tiles_y;
+    // One list of triangle indexes per tile, kept in submission order.
+    Array<i32>  *triangles;
+};
+
+internal TileBins
+tile_bins_make(i32 width, i32 height)
+{
+    TileBins bins;
+    bins.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    bins.tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    bins.triangles = (Array<i32>*)malloc(sizeof(Array<i32>) * bins.tiles_x * bins.tiles_y);
+
+    for (i32 i = 0; i < bins.tiles_x * bins.tiles_y; i++)
+        bins.triangles[i] = array_make<i32>();
+
+    return bins;
 }
 
 internal void
-obj_file_free(ObjFile *f)
+tile_bins_free(TileBins *bins)
 {
-    array_free(&f->vertices);
-    array_free(&f->tex_coords);
-    array_free(&f->faces_vertices);
-    array_free(&f->faces_textures);
-    array_free(&f->faces_normals);
+    for (i32 i = 0; i < bins->tiles_x * bins->tiles_y; i++)
+        array_free(&bins->triangles[i]);
+    lt_free(bins->triangles);
 }
 
-Vec3f
-barycentric(const Vec3f A, const Vec3f B, const Vec3f C, const Vec3f P)
+internal void
+tile_bins_insert(TileBins *bins, i32 triangle_index, const TriangleSetup *setup)
 {
-    Vec3f s[2];
-    for (int i=2; i--; ) {
-        s[i].val[0] = C.val[i]-A.val[i];
-        s[i].val[1] = B.val[i]-A.val[i];
-        s[i].val[2] = A.val[i]-P.val[i];
-    }
-    Vec3f u = vec_cross(s[0], s[1]);
-    // dont forget that u[2] is integer. If it is zero then triangle ABC is degenerate
-    if (std::abs(u.val[2])>1e-2)
-        return Vec3f(1.f-(u.x+u.y)/u.z, u.y/u.z, u.x/u.z);
-    // in this case generate negative coordinates, it will be thrown away by the rasterizator
-    return Vec3f(-1,1,1);
+    // Triangles that are partially off screen are only binned into the tiles they touch.
+    i32 min_tx = lt_max(setup->min_x / TILE_SIZE, 0);
+    i32 min_ty = lt_max(setup->min_y / TILE_SIZE, 0);
+    i32 max_tx = lt_min(setup->max_x / TILE_SIZE, bins->tiles_x - 1);
+    i32 max_ty = lt_min(setup->max_y / TILE_SIZE, bins->tiles_y - 1);
+
+    for (i32 ty = min_ty; ty <= max_ty; ty++)
+        for (i32 tx = min_tx; tx <= max_tx; tx++)
+            array_push(&bins->triangles[tx + (ty * bins->tiles_x)], triangle_index);
 }
 
+struct RasterJob;
+typedef void (*TileProc)(RasterJob *job, i32 tile_index);
+
+struct RasterJob
+{
+    RenderTarget     *target;
+    TileBins         *bins;
+    Array<Triangle>  *triangles;
+    // What the workers do with each tile.
+    TileProc          tile_proc;
+    // Index of the next tile to be picked up by a worker.
+    i32               next_tile;
+};
+
+// Pixel bounds of a tile, inclusive.
 internal void
-draw_filled_triangle(TGAImageRGBA *img, TGAImageRGB *tex, i32 z_buffer[],
-                     Vertex3 *v1, Vertex3 *v2, Vertex3 *v3, f32 intensity)
+tile_bounds(RasterJob *job, i32 tile_index, i32 *min_x, i32 *min_y, i32 *max_x, i32 *max_y)
 {
-    //
-    // Find the bounding box of the triangle
-    //
-    i32 min_x = lt_min(v1->vertice.x, v2->vertice.x, v3->vertice.x);
-    i32 max_x = lt_max(v1->vertice.x, v2->vertice.x, v3->vertice.x);
-    i32 min_y = lt_min(v1->vertice.y, v2->vertice.y, v3->vertice.y);
-    i32 max_y = lt_max(v1->vertice.y, v2->vertice.y, v3->vertice.y);
+    const i32 tx = tile_index % job->bins->tiles_x;
+    const i32 ty = tile_index / job->bins->tiles_x;
+    *min_x = tx * TILE_SIZE;
+    *min_y = ty * TILE_SIZE;
+    *max_x = lt_min(*min_x + TILE_SIZE, job->target->width) - 1;
+    *max_y = lt_min(*min_y + TILE_SIZE, job->target->height) - 1;
+}
 
-    //
-    // Rearrange the vertices in counter clockwise order
-    //
-    //TODO(leo): See if this is necessary.
+internal void
+raster_tile(RasterJob *job, i32 tile_index)
+{
+    i32 min_x, min_y, max_x, max_y;
+    tile_bounds(job, tile_index, &min_x, &min_y, &max_x, &max_y);
 
-    Vec3f p = {};
-    for (p.y = min_y; p.y <= max_y; p.y++)
+    Array<i32> *bin = &job->bins->triangles[tile_index];
+    for (isize i = 0; i < bin->len; i++)
     {
-        for (p.x = min_x; p.x <= max_x; p.x++)
-        {
-            Vec3f bc_screen = barycentric(v1->vertice, v2->vertice, v3->vertice, p);
+        const u32 triangle_id = bin->data[i];
+        const Triangle *tri = &job->triangles->data[triangle_id];
+
+        // The whole triangle is behind everything that is already in the tile.
+        if (tri->min_depth >= job->target->hiz.tile_max[tile_index])
+            continue;
 
-            if (bc_screen.x < 0 || bc_screen.y < 0 || bc_screen.z < 0) continue;
+        if (draw_filled_triangle(job->target, tri, triangle_id, min_x, min_y, max_x, max_y))
+            hiz_update_tile(job->target, min_x / TILE_SIZE, min_y / TILE_SIZE);
+    }
+}
+
+// Shades the pixels of a tile from the visibility buffer.
+internal void
+resolve_tile(RasterJob *job, i32 tile_index)
+{
+    const RenderTarget *target = job->target;
+    const VisibilityBuffer *vis = target->visibility;
 
-            isize z_buffer_index = p.x + (p.y * IMAGE_WIDTH);
-            p.z = (bc_screen.x * v1->vertice.z) + (bc_screen.y * v2->vertice.z) + (bc_screen.z * v3->vertice.z);
+    i32 min_x, min_y, max_x, max_y;
+    tile_bounds(job, tile_index, &min_x, &min_y, &max_x, &max_y);
 
-            if (p.z < z_buffer[z_buffer_index])
-            {
-                z_buffer[z_buffer_index] = p.z;
-                Vec3i color1 = lt_image_get(tex,
-                                            v1->tex_coord.x*(lt_image_width(tex)-1),
-                                            v1->tex_coord.y*(lt_image_height(tex)-1));
-                Vec3i color2 = lt_image_get(tex,
-                                            v2->tex_coord.x*(lt_image_width(tex)-1),
-                                            v2->tex_coord.y*(lt_image_height(tex)-1));
-                Vec3i color3 = lt_image_get(tex,
-                                            v3->tex_coord.x*(lt_image_width(tex)-1),
-                                            v3->tex_coord.y*(lt_image_height(tex)-1));
-                Vec3i color = color1*bc_screen.x + color2*bc_screen.y + color3*bc_screen.z;
-                // Vec3i color(255,255,255);
-                lt_image_set(img, p.x, p.y, Vec4i(color*intensity, 255));
-            }
+    for (i32 y = min_y; y <= max_y; y++)
+    {
+        for (i32 x = min_x; x <= max_x; x++)
+        {
+            const isize index = target_pixel_index(target, x, y);
+            const u32 triangle_id = vis->triangle_ids[index];
+            if (triangle_id == VISIBILITY_EMPTY)
+                continue;
+
+            const f32 b2 = vis->barycentrics[0][index];
+            const f32 b3 = vis->barycentrics[1][index];
+            target->color->data[index] = shade_pixel(&job->triangles->data[triangle_id], 1.0f - b2 - b3, b2, b3);
         }
     }
 }
 
+internal void
+tile_worker(void *data, i32 thread_index)
+{
+    LT_UNUSED(thread_index);
+    RasterJob *job = (RasterJob*)data;
+    const i32 num_tiles = job->bins->tiles_x * job->bins->tiles_y;
+
+    for (;;)
+    {
+        i32 tile_index = __sync_fetch_and_add(&job->next_tile, 1);
+        if (tile_index >= num_tiles)
+            break;
+        job->tile_proc(job, tile_index);
+    }
+}
 
 internal void
 draw_line(TGAImageRGBA *img, Vec2i p0, Vec2i p1, const Vec4i color)
@@ -247,10 +2427,245 @@ draw_line(TGAImageRGBA *img, Vec2i p0, Vec2i p1, const Vec4i color)
     }
 }
 
-inline Vec3f
-normalized2screen(const Vec3f n, const i32 width, const i32 height)
+/////////////////////////////////////////////////////////
+//
+// Vertex processing and clipping
+//
+// Triangles are only clipped when they cross the near or far planes, or when they
+// leave a guard band around the viewport. Inside the guard band the rasterizer takes
+// care of the pixels off the viewport, since its bounding box is clamped to the render
+// target, so the common case costs no clipping at all. The guard band is as big as
+// the fixed point range of the rasterizer allows. Triangles that are entirely outside
+// the viewport are rejected before being assembled.
+//
+
+enum ClipFlag
+{
+    // Outside the viewport, only used to reject triangles.
+    ClipFlag_Left        = 1 << 0,
+    ClipFlag_Right       = 1 << 1,
+    ClipFlag_Bottom      = 1 << 2,
+    ClipFlag_Top         = 1 << 3,
+    // Outside the guard band, the triangle has to be clipped.
+    ClipFlag_GuardLeft   = 1 << 4,
+    ClipFlag_GuardRight  = 1 << 5,
+    ClipFlag_GuardBottom = 1 << 6,
+    ClipFlag_GuardTop    = 1 << 7,
+    ClipFlag_Near        = 1 << 8,
+    ClipFlag_Far         = 1 << 9,
+};
+
+#define CLIP_FLAGS_GUARD_BAND (ClipFlag_GuardLeft | ClipFlag_GuardRight | ClipFlag_GuardBottom | ClipFlag_GuardTop)
+#define CLIP_FLAGS_MUST_CLIP  (CLIP_FLAGS_GUARD_BAND | ClipFlag_Near | ClipFlag_Far)
+
+// A clipped polygon gets at most one more vertex for each of the six planes.
+#define CLIP_MAX_VERTICES 9
+
+// Pixels that the guard band extends past each side of the viewport, at least one for
+// targets up to MAX_TARGET_SIZE.
+internal inline f32
+clip_guard_band(i32 size)
+{
+    const i32 guard_band = (((MAX_TRIANGLE_EXTENT >> SUBPIXEL_BITS) - size) / 2) - 1;
+    LT_Assert(guard_band > 0);
+    return (f32)guard_band;
+}
+
+// Screen space positions of the mesh vertices, stored in streams like the mesh.
+struct ScreenVertices
+{
+    f32 *x;
+    f32 *y;
+    f32 *z;
+    f32 *inv_w;
+    // ClipFlag values of each vertex.
+    u16 *clip_flags;
+};
+
+// Moves every vertex of the mesh to screen space once. Triangles that share a vertex
+// read its transformed position from here instead of transforming it again.
+//
+// NOTE: After the projection smaller depths are closer to the viewer. The position
+// is not rounded, the rasterizer snaps it to its subpixel grid.
+internal void
+process_vertices(const Mesh *mesh, const Mat4 mvp, ScreenVertices *screen, i32 width, i32 height)
+{
+    // Checked in every build, a bigger target would silently lose its clipped triangles.
+    if (width > MAX_TARGET_SIZE || height > MAX_TARGET_SIZE)
+    {
+        fprintf(stderr, "Render target %dx%d is bigger than %dx%d\n", width, height, MAX_TARGET_SIZE, MAX_TARGET_SIZE);
+        abort();
+    }
+
+    // The streams are padded, so the padding is transformed too and there is no
+    // scalar tail.
+    mat4_transform_points(mvp, mesh->x, mesh->y, mesh->z, mesh_stream_len(mesh->num_vertices),
+                          (f32)width, (f32)height, screen->x, screen->y, screen->z, screen->inv_w);
+
+    const f32 guard_x = clip_guard_band(width);
+    const f32 guard_y = clip_guard_band(height);
+
+    for (isize i = 0; i < mesh->num_vertices; i++)
+    {
+        const f32 x = screen->x[i];
+        const f32 y = screen->y[i];
+        const f32 z = screen->z[i];
+
+        // Behind the eye the projected position means nothing, it can only be clipped.
+        if (!(screen->inv_w[i] > 0.0f))
+        {
+            screen->clip_flags[i] = ClipFlag_Near;
+            continue;
+        }
+
+        u16 flags = 0;
+        if (x < 0.0f)              flags |= ClipFlag_Left;
+        if (x > width)             flags |= ClipFlag_Right;
+        if (y < 0.0f)              flags |= ClipFlag_Bottom;
+        if (y > height)            flags |= ClipFlag_Top;
+        if (x < -guard_x)          flags |= ClipFlag_GuardLeft;
+        if (x > width + guard_x)   flags |= ClipFlag_GuardRight;
+        if (y < -guard_y)          flags |= ClipFlag_GuardBottom;
+        if (y > height + guard_y)  flags |= ClipFlag_GuardTop;
+        if (z < -1.0f)             flags |= ClipFlag_Near;
+        if (z > 1.0f)              flags |= ClipFlag_Far;
+        screen->clip_flags[i] = flags;
+    }
+}
+
+// Assembles a triangle, clamps it to the render target and bins it.
+internal void
+submit_triangle(Array<Triangle> *triangles, TileBins *bins, TGAImageRGB *texture,
+                Vertex3 *v1, Vertex3 *v2, Vertex3 *v3, f32 intensity, i32 width, i32 height)
+{
+    Triangle tri;
+    if (!triangle_assemble(&tri, texture, v1, v2, v3, intensity))
+        return;
+
+    TriangleSetup *setup = &tri.setup;
+    setup->min_x = lt_max(setup->min_x, 0);
+    setup->min_y = lt_max(setup->min_y, 0);
+    setup->max_x = lt_min(setup->max_x, width - 1);
+    setup->max_y = lt_min(setup->max_y, height - 1);
+    if (setup->min_x > setup->max_x || setup->min_y > setup->max_y)
+        return;
+
+    tile_bins_insert(bins, triangles->len, setup);
+    array_push(triangles, tri);
+}
+
+struct ClipVertex
+{
+    // Clip space position.
+    f32 c[4];
+    f32 u, v;
+};
+
+// Clips the polygon against the plane dot(plane, c) >= 0. Returns the new number of
+// vertices.
+internal i32
+clip_polygon(const ClipVertex *in, i32 num_in, ClipVertex *out, const f32 plane[4])
+{
+    i32 num_out = 0;
+    for (i32 i = 0; i < num_in; i++)
+    {
+        const ClipVertex *a = &in[i];
+        const ClipVertex *b = &in[(i + 1) % num_in];
+        const f32 da = (plane[0] * a->c[0]) + (plane[1] * a->c[1]) + (plane[2] * a->c[2]) + (plane[3] * a->c[3]);
+        const f32 db = (plane[0] * b->c[0]) + (plane[1] * b->c[1]) + (plane[2] * b->c[2]) + (plane[3] * b->c[3]);
+
+        if (da >= 0.0f)
+            out[num_out++] = *a;
+
+        if ((da >= 0.0f) != (db >= 0.0f))
+        {
+            // Everything is linear in clip space, so the attributes are interpolated
+            // the same way as the position.
+            const f32 t = da / (da - db);
+            ClipVertex *c = &out[num_out++];
+            for (i32 k = 0; k < 4; k++)
+                c->c[k] = a->c[k] + ((b->c[k] - a->c[k]) * t);
+            c->u = a->u + ((b->u - a->u) * t);
+            c->v = a->v + ((b->v - a->v) * t);
+        }
+    }
+    return num_out;
+}
+
+// Same mapping as mat4_transform_points.
+internal inline Vertex3
+clip_vertex_project(const ClipVertex *v, i32 width, i32 height)
+{
+    const f32 inv_w = 1.0f / v->c[3];
+    const Vec3f position(((v->c[0] * inv_w) + 1.0f) * (width * 0.5f),
+                         ((v->c[1] * inv_w) + 1.0f) * (height * 0.5f),
+                         v->c[2] * inv_w);
+
+    Vertex3 vertex(position, Vec3f(v->u, v->v, 0));
+    vertex.inv_w = inv_w;
+    return vertex;
+}
+
+// Clips a triangle in homogeneous clip space against the planes it crosses, then
+// submits the polygon that is left as a fan of triangles.
+internal void
+clip_triangle(Array<Triangle> *triangles, TileBins *bins, TGAImageRGB *texture,
+              const Mesh *mesh, const Mat4 mvp, const u32 indexes[3], u16 clip_flags,
+              f32 intensity, i32 width, i32 height)
 {
-    return Vec3f((i32)((n.x+1.)*(width/2.-1.)+.5), (i32)((n.y+1.)*(height/2.-1.)+.5), n.z);
+    ClipVertex buffers[2][CLIP_MAX_VERTICES + 1];
+    ClipVertex *polygon = buffers[0];
+    i32 num_vertices = 3;
+
+    for (i32 i = 0; i < 3; i++)
+    {
+        const u32 index = indexes[i];
+        for (i32 row = 0; row < 4; row++)
+        {
+            polygon[i].c[row] = (mvp.m[row][0] * mesh->x[index]) + (mvp.m[row][1] * mesh->y[index]) +
+                                (mvp.m[row][2] * mesh->z[index]) + mvp.m[row][3];
+        }
+        polygon[i].u = mesh->u[index];
+        polygon[i].v = mesh->v[index];
+    }
+
+    // Vertices behind the eye have no meaningful screen position, so any of the guard
+    // band planes can be crossed once the near plane is clipped.
+    if (clip_flags & ClipFlag_Near)
+        clip_flags |= CLIP_FLAGS_GUARD_BAND;
+
+    const f32 gx = 1.0f + ((2.0f * clip_guard_band(width)) / width);
+    const f32 gy = 1.0f + ((2.0f * clip_guard_band(height)) / height);
+    const struct { u16 flag; f32 plane[4]; } planes[] = {
+        {ClipFlag_Near,        { 0.0f,  0.0f,  1.0f, 1.0f}},
+        {ClipFlag_Far,         { 0.0f,  0.0f, -1.0f, 1.0f}},
+        {ClipFlag_GuardLeft,   { 1.0f,  0.0f,  0.0f, gx}},
+        {ClipFlag_GuardRight,  {-1.0f,  0.0f,  0.0f, gx}},
+        {ClipFlag_GuardBottom, { 0.0f,  1.0f,  0.0f, gy}},
+        {ClipFlag_GuardTop,    { 0.0f, -1.0f,  0.0f, gy}},
+    };
+
+    for (i32 p = 0; p < (i32)lt_count(planes) && num_vertices >= 3; p++)
+    {
+        if (!(clip_flags & planes[p].flag))
+            continue;
+
+        ClipVertex *clipped = (polygon == buffers[0]) ? buffers[1] : buffers[0];
+        num_vertices = clip_polygon(polygon, num_vertices, clipped, planes[p].plane);
+        polygon = clipped;
+    }
+
+    if (num_vertices < 3)
+        return;
+
+    Vertex3 first = clip_vertex_project(&polygon[0], width, height);
+    Vertex3 previous = clip_vertex_project(&polygon[1], width, height);
+    for (i32 i = 2; i < num_vertices; i++)
+    {
+        Vertex3 current = clip_vertex_project(&polygon[i], width, height);
+        submit_triangle(triangles, bins, texture, &first, &previous, &current, intensity, width, height);
+        previous = current;
+    }
 }
 
 int
@@ -261,48 +2676,119 @@ main(void)
     const Vec4i red(255, 0, 0, 255);
     const Vec4i white(255, 255, 255, 255);
 
-    ObjFile obj = obj_file_load("resources/african_head.obj");
-    TGAImageRGB *texture = lt_image_load_rgb("resources/african_head_diffuse.tga");
-    TGAImageRGBA *img = lt_image_make_rgba(IMAGE_WIDTH, IMAGE_HEIGHT);
+    ObjFile obj = obj_file_load("resources/african_head.obj", OPTIMIZE_MESH);
+    Mesh mesh = mesh_weld(&obj);
+    obj_file_free(&obj);
+    TGAImageRGB *texture = lt_image_load_rgb("resources/african_head_diffuse.tga", TGALayout_Blocked);
+    TGAImageRGBA *img = lt_image_make_rgba_tiled(IMAGE_WIDTH, IMAGE_HEIGHT, TILE_SIZE);
 
     lt_image_fill(img, blue);
 
-    local_persist i32 z_buffer[IMAGE_WIDTH * IMAGE_HEIGHT] = {};
+    const isize target_size = target_storage(IMAGE_WIDTH, IMAGE_HEIGHT);
+    f32 *z_buffer = (f32*)malloc(sizeof(f32) * target_size);
 
     // Initialize the z buffer.
-    for (isize y = 0; y < IMAGE_HEIGHT; y++)
-        for (isize x = 0; x < IMAGE_WIDTH; x++)
-            z_buffer[x + (y * IMAGE_WIDTH)] = INT_MAX;
+    for (isize i = 0; i < target_size; i++)
+        z_buffer[i] = FLT_MAX;
+
+    // The color surface is indexed the same way as the others.
+    LT_Assert(img->tile_size == TILE_SIZE);
+
+    RenderTarget target;
+    target.color = img;
+    target.depth = z_buffer;
+    target.hiz = hiz_make(IMAGE_WIDTH, IMAGE_HEIGHT);
+    target.visibility = NULL;
+    target.width = IMAGE_WIDTH;
+    target.height = IMAGE_HEIGHT;
+
+    VisibilityBuffer visibility;
+    if (VISIBILITY_BUFFER_MODE)
+    {
+        visibility = visibility_buffer_make(target_size);
+        target.visibility = &visibility;
+    }
+
+    Array<Triangle> triangles = array_make<Triangle>();
+    TileBins bins = tile_bins_make(IMAGE_WIDTH, IMAGE_HEIGHT);
 
     // FIXME(leo): Changing the light direction kind of breaks the lighting.
     Vec3f light_dir(0.0f, 0.0f, -1.0f);
-    for (isize f = 0; f < obj.faces_vertices.len; f++)
+    const Mat4 view = mat4_look_at(Vec3f(0.0f, 0.0f, 3.0f), Vec3f(0.0f, 0.0f, 0.0f), Vec3f(0.0f, 1.0f, 0.0f));
+    const Mat4 projection = mat4_perspective(45.0f, (f32)IMAGE_WIDTH / IMAGE_HEIGHT, 0.1f, 10.0f);
+    const Mat4 mvp = mat4_mul(projection, view);
+
+    ScreenVertices screen;
+    f32 **screen_streams[] = {&screen.x, &screen.y, &screen.z, &screen.inv_w};
+    mesh_streams_alloc(mesh.num_vertices, screen_streams, lt_count(screen_streams));
+    screen.clip_flags = (u16*)malloc(sizeof(u16) * mesh.num_vertices);
+    process_vertices(&mesh, mvp, &screen, IMAGE_WIDTH, IMAGE_HEIGHT);
+
+    for (isize f = 0; f < mesh.indices.len / 3; f++)
     {
-        Vec3i face_v = obj.faces_vertices[f];
-        Vec3i face_t = obj.faces_textures[f];
+        const u32 i1 = mesh.indices.data[(f * 3) + 0];
+        const u32 i2 = mesh.indices.data[(f * 3) + 1];
+        const u32 i3 = mesh.indices.data[(f * 3) + 2];
+        const Vec3f p1 = mesh_position(&mesh, i1);
+        const Vec3f p2 = mesh_position(&mesh, i2);
+        const Vec3f p3 = mesh_position(&mesh, i3);
 
-        Vertex3 v1(obj.vertices[face_v.val[0]], obj.tex_coords[face_t.val[0]]);
-        Vertex3 v2(obj.vertices[face_v.val[1]], obj.tex_coords[face_t.val[1]]);
-        Vertex3 v3(obj.vertices[face_v.val[2]], obj.tex_coords[face_t.val[2]]);
-        Vec3f triangle_normal = vec_normalize(
-            vec_cross(v3.vertice - v1.vertice, v2.vertice - v1.vertice)
-        );
+        Vec3f triangle_normal = vec_normalize(vec_cross(p3 - p1, p2 - p1));
 
         f32 intensity = vec_dot(light_dir, triangle_normal);
+        if (intensity <= 0)
+            continue;
+
+        // All the vertices are on the outer side of the same plane.
+        const u16 f1 = screen.clip_flags[i1], f2 = screen.clip_flags[i2], f3 = screen.clip_flags[i3];
+        if (f1 & f2 & f3)
+            continue;
 
-        if (intensity > 0)
+        if ((f1 | f2 | f3) & CLIP_FLAGS_MUST_CLIP)
         {
-            v1.vertice = normalized2screen(v1.vertice, IMAGE_WIDTH, IMAGE_HEIGHT);
-            v2.vertice = normalized2screen(v2.vertice, IMAGE_WIDTH, IMAGE_HEIGHT);
-            v3.vertice = normalized2screen(v3.vertice, IMAGE_WIDTH, IMAGE_HEIGHT);
-            draw_filled_triangle(img, texture, z_buffer, &v1, &v2, &v3, intensity);
+            const u32 indexes[3] = {i1, i2, i3};
+            clip_triangle(&triangles, &bins, texture, &mesh, mvp, indexes, f1 | f2 | f3,
+                          intensity, IMAGE_WIDTH, IMAGE_HEIGHT);
+            continue;
         }
+
+        Vertex3 v1(Vec3f(screen.x[i1], screen.y[i1], screen.z[i1]), Vec3f(mesh.u[i1], mesh.v[i1], 0));
+        Vertex3 v2(Vec3f(screen.x[i2], screen.y[i2], screen.z[i2]), Vec3f(mesh.u[i2], mesh.v[i2], 0));
+        Vertex3 v3(Vec3f(screen.x[i3], screen.y[i3], screen.z[i3]), Vec3f(mesh.u[i3], mesh.v[i3], 0));
+        v1.inv_w = screen.inv_w[i1];
+        v2.inv_w = screen.inv_w[i2];
+        v3.inv_w = screen.inv_w[i3];
+
+        submit_triangle(&triangles, &bins, texture, &v1, &v2, &v3, intensity, IMAGE_WIDTH, IMAGE_HEIGHT);
+    }
+
+    RasterJob job;
+    job.target = &target;
+    job.bins = &bins;
+    job.triangles = &triangles;
+    job.tile_proc = raster_tile;
+    job.next_tile = 0;
+    thread_run_parallel(tile_worker, &job, thread_hardware_count());
+
+    if (target.visibility)
+    {
+        job.tile_proc = resolve_tile;
+        job.next_tile = 0;
+        thread_run_parallel(tile_worker, &job, thread_hardware_count());
+        visibility_buffer_free(&visibility);
     }
 
+    free(screen.x);
+    free(screen.clip_flags);
+    tile_bins_free(&bins);
+    array_free(&triangles);
+    hiz_free(&target.hiz);
+    lt_free(z_buffer);
+
     // output and cleanup
-    lt_image_write_to_file(img, "../test.tga");
+    lt_image_write_to_file(img, "../test.tga", TGACompression_RunLength);
     lt_image_write_to_file(texture, "../out-texture.tga");
     lt_image_free(img);
     lt_image_free(texture);
-    obj_file_free(&obj);
+    mesh_free(&mesh);
 }